@@ -8,6 +8,9 @@
 #include <string.h>
 #include "m17nutil.h"
 #include "engine.h"
+#include "keytrace.h"
+#include "stats.h"
+#include "uiconfig.h"
 
 /* type module to assign different GType to each engine */
 #define IBUS_TYPE_M17N_TYPE_MODULE (ibus_m17n_type_module_get_type ())
@@ -26,14 +29,131 @@ struct _IBusM17NTypeModuleClass
     GTypeModuleClass parent_class;
 };
 
+/* scratch memory for the temporaries of one key event */
+typedef struct _IBusM17NArena IBusM17NArena;
+
+struct _IBusM17NArena {
+    gchar *data;
+    gsize size;
+    gsize used;
+
+    /* blocks allocated when data was exhausted */
+    GSList *overflow;
+    gsize overflow_size;
+};
+
+#define ARENA_INITIAL_SIZE 1024
+
+/* the preedit as last sent to the client */
+typedef struct _IBusM17NPreeditState IBusM17NPreeditState;
+
+struct _IBusM17NPreeditState {
+    /* FALSE if the client state is unknown and must be resent */
+    gboolean valid;
+    gboolean visible;
+    MText *text;
+    gint cursor_pos;
+    guint foreground;
+    guint background;
+    gint underline;
+};
+
+/* UI changes requested by m17n-lib callbacks, sent to the client at
+   the end of the key event which caused them */
+typedef struct _IBusM17NPendingUpdate IBusM17NPendingUpdate;
+
+struct _IBusM17NPendingUpdate {
+    /* text to commit, allocated from the arena */
+    const gchar *commit;
+    gboolean preedit;
+    gboolean lookup_table;
+    gboolean status;
+};
+
+/* an event received before the input method was opened */
+typedef struct _IBusM17NQueuedEvent IBusM17NQueuedEvent;
+
+struct _IBusM17NQueuedEvent {
+    IBusM17NKeyTraceType type;
+    guint keyval;
+    guint keycode;
+    guint modifiers;
+};
+
+/* the candidate page as last sent to the client */
+typedef struct _IBusM17NLookupState IBusM17NLookupState;
+
+struct _IBusM17NLookupState {
+    /* FALSE if the panel may not show what was last sent, e.g. after it
+       hid the table on focus out */
+    gboolean valid;
+    gboolean visible;
+    /* candidate list the page belongs to, referenced so that it cannot
+       be recycled into a different list while we compare against it */
+    MPlist *candidate_list;
+    /* index of the first candidate of the page and its size */
+    gint start;
+    gint length;
+    gint orientation;
+};
+
+/* candidates of one group of a candidate list, converted for IBus */
+typedef struct _IBusM17NCandidatePage IBusM17NCandidatePage;
+
+struct _IBusM17NCandidatePage {
+    /* the MText or MPlist of the group, referenced */
+    gpointer group;
+    /* fingerprint of the contents of group when it was converted */
+    guint hash;
+    /* IBusText for each candidate */
+    GPtrArray *candidates;
+    /* link in the class' LRU queue */
+    GList *link;
+};
+
+#define MAX_CANDIDATE_PAGES 64
+
+/* number of recently used engines opened after the component starts */
+#define MRU_SIZE 8
+
+/* seconds to gather engine switches before the list is written */
+#define MRU_SAVE_DELAY 5
+
+/* milliseconds to wait for more changes to the m17n database before
+   reloading it */
+#define RELOAD_DELAY 500
+
 typedef struct _IBusM17NEngine IBusM17NEngine;
 typedef struct _IBusM17NEngineClass IBusM17NEngineClass;
+typedef struct _IBusM17NEngineClassData IBusM17NEngineClassData;
 
 struct _IBusM17NEngine {
     IBusEngine parent;
 
     /* members */
     MInputContext *context;
+    MText *produced;
+    IBusM17NArena arena;
+    IBusM17NPreeditState preedit;
+    IBusM17NPendingUpdate pending;
+    IBusM17NLookupState lookup;
+
+    /* time spent converting text in the current key event */
+    gint64 convert_usec;
+
+    /* id in the key event trace, 0 if not recorded */
+    guint trace_engine;
+    /* TRUE while a handler runs as part of another recorded event */
+    gboolean trace_nested;
+
+    /* TRUE while context is known to be in the initial state of the
+       input method, i.e. after a reset or a key it did not handle */
+    gboolean idle;
+
+    /* key events received before the input method was opened */
+    GQueue queued_events;
+    gboolean focused;
+
     IBusLookupTable *table;
     IBusProperty    *status_prop;
 #ifdef HAVE_SETUP
@@ -45,6 +165,9 @@ struct _IBusM17NEngine {
 struct _IBusM17NEngineClass {
     IBusEngineClass parent;
 
+    /* engine name, owned by the class data */
+    const gchar *engine_name;
+
     /* configurations are per class */
     gchar *config_section;
     guint preedit_foreground;
@@ -52,14 +175,56 @@ struct _IBusM17NEngineClass {
     gint preedit_underline;
     gint lookup_table_orientation;
 
+    MSymbol im_lang;
+    MSymbol im_name;
     MInputMethod *im;
+
+    /* the idle callback opening im, and the engines waiting for it */
+    guint open_im_id;
+    GSList *waiting_engines;
+
+    /* all the engines of the class, and a hash of the customization of
+       im in config.mic when im was opened */
+    GSList *engines;
+    guint im_config_hash;
+
+    /* printable ASCII keys bound anywhere in the maps or commands of im;
+       only meaningful if consumable_keys_known is TRUE */
+    guint32 consumable_keys[4];
+    gboolean consumable_keys_known;
+
+    /* converted candidate pages by group, most recently used first */
+    GHashTable *candidate_pages;
+    GQueue candidate_page_lru;
+
+    /* latency statistics, NULL unless enabled */
+    IBusM17NStats *stats;
+};
+
+/* passed to class_init of the type registered for an engine */
+struct _IBusM17NEngineClassData {
+    gchar *engine_name;
+    gchar *lang;
+    gchar *name;
 };
 
 /* functions prototype */
 static GType
             ibus_m17n_type_module_get_type  (void);
-static void ibus_m17n_engine_class_init     (IBusM17NEngineClass    *klass);
+static void ibus_m17n_engine_class_init     (IBusM17NEngineClass    *klass,
+                                             IBusM17NEngineClassData
+                                                                    *class_data);
 static void ibus_m17n_engine_class_finalize (IBusM17NEngineClass    *klass);
+static void ibus_m17n_engine_class_set_defaults
+                                            (IBusM17NEngineClass    *klass);
+static void ibus_m17n_engine_class_load_config
+                                            (IBusM17NEngineClass    *klass);
+#if IBUS_CHECK_VERSION(1,4,0)
+static void ibus_m17n_engine_class_config_cb
+                                            (GObject                *source,
+                                             GAsyncResult           *result,
+                                             gpointer                user_data);
+#endif  /* IBUS_CHECK_VERSION(1,4,0) */
 static void ibus_m17n_config_value_changed  (IBusConfig             *config,
                                              const gchar            *section,
                                              const gchar            *name,
@@ -68,13 +233,16 @@ static void ibus_m17n_config_value_changed  (IBusConfig             *config,
 #else
                                              GValue                 *value,
 #endif  /* !IBUS_CHECK_VERSION(1,3,99) */
-                                             IBusM17NEngineClass    *klass);
+                                             gpointer                user_data);
 
 static GObject*
             ibus_m17n_engine_constructor    (GType                   type,
                                              guint                   n_construct_params,
                                              GObjectConstructParam  *construct_params);
 static void ibus_m17n_engine_init           (IBusM17NEngine         *m17n);
+static gboolean
+            ibus_m17n_engine_class_open_im_cb
+                                            (IBusM17NEngineClass    *klass);
 static void ibus_m17n_engine_destroy        (IBusM17NEngine         *m17n);
 static gboolean
             ibus_m17n_engine_process_key_event
@@ -116,20 +284,34 @@ static void ibus_m17n_engine_commit_string
 static void ibus_m17n_engine_callback       (MInputContext          *context,
                                              MSymbol                 command);
 static void ibus_m17n_engine_update_preedit (IBusM17NEngine *m17n);
+static void ibus_m17n_engine_flush          (IBusM17NEngine *m17n);
 static void ibus_m17n_engine_update_lookup_table
                                             (IBusM17NEngine *m17n);
+static guint
+            ibus_m17n_engine_class_config_hash
+                                            (IBusM17NEngineClass *klass);
 
 static IBusEngineClass *parent_class = NULL;
 
 static IBusConfig      *config = NULL;
 static IBusM17NTypeModule *module = NULL;
 
+/* engine classes by config section, and config setters by key name */
+static GHashTable      *engine_classes = NULL;
+static GHashTable      *config_setters = NULL;
+
 void
 ibus_m17n_init (IBusBus *bus)
 {
-    config = ibus_bus_get_config (bus);
-    if (config)
+    /* bus is NULL when the engine is driven without ibus-daemon */
+    if (bus)
+        config = ibus_bus_get_config (bus);
+    if (config) {
         g_object_ref_sink (config);
+        g_signal_connect (config, "value-changed",
+                          G_CALLBACK(ibus_m17n_config_value_changed),
+                          NULL);
+    }
     ibus_m17n_init_common ();
 
     module = g_object_new (IBUS_TYPE_M17N_TYPE_MODULE, NULL);
@@ -182,6 +364,65 @@ ibus_m17n_type_module_get_type (void)
     return type;
 }
 
+static void
+ibus_m17n_arena_init (IBusM17NArena *arena,
+                      gsize          size)
+{
+    arena->data = g_malloc (size);
+    arena->size = size;
+    arena->used = 0;
+    arena->overflow = NULL;
+    arena->overflow_size = 0;
+}
+
+/* Allocations are only valid until the next ibus_m17n_arena_reset().  A
+   request which does not fit the block is served from the heap, and the
+   block is grown at reset time so that the next key event fits. */
+static gpointer
+ibus_m17n_arena_alloc (IBusM17NArena *arena,
+                       gsize          size)
+{
+    gpointer mem;
+
+    size = (size + 7) & ~(gsize) 7;
+
+    if (arena->used + size <= arena->size) {
+        mem = arena->data + arena->used;
+        arena->used += size;
+        return mem;
+    }
+
+    mem = g_malloc (size);
+    arena->overflow = g_slist_prepend (arena->overflow, mem);
+    arena->overflow_size += size;
+    return mem;
+}
+
+static void
+ibus_m17n_arena_reset (IBusM17NArena *arena)
+{
+    if (arena->overflow != NULL) {
+        g_slist_foreach (arena->overflow, (GFunc) g_free, NULL);
+        g_slist_free (arena->overflow);
+        arena->overflow = NULL;
+
+        g_free (arena->data);
+        arena->size += arena->overflow_size;
+        arena->data = g_malloc (arena->size);
+        arena->overflow_size = 0;
+    }
+    arena->used = 0;
+}
+
+static void
+ibus_m17n_arena_clear (IBusM17NArena *arena)
+{
+    ibus_m17n_arena_reset (arena);
+    g_free (arena->data);
+    arena->data = NULL;
+    arena->size = 0;
+}
+
 static gboolean
 ibus_m17n_scan_engine_name (const gchar *engine_name,
                             gchar      **lang,
@@ -206,39 +447,15 @@ ibus_m17n_scan_engine_name (const gchar *engine_name,
     return TRUE;
 }
 
-static gboolean
-ibus_m17n_scan_class_name (const gchar *class_name,
-                           gchar      **lang,
-                           gchar      **name)
-{
-    gchar *p;
-
-    g_return_val_if_fail (g_str_has_prefix (class_name, "IBusM17N"), FALSE);
-    g_return_val_if_fail (g_str_has_suffix (class_name, "Engine"), FALSE);
-
-    /* Strip prefix and suffix */
-    p = *lang = g_strdup (class_name + 8);
-    p = g_strrstr (p, "Engine");
-    *p = '\0';
-
-    /* Find the start position of <Name> */
-    while (!g_ascii_isupper (*--p) && p > *lang)
-        ;
-    g_return_val_if_fail (p > *lang, FALSE);
-    *name = g_strdup (p);
-    *p = '\0';
-
-    *lang[0] = g_ascii_tolower (*lang[0]);
-    *name[0] = g_ascii_tolower (*name[0]);
-
-    return TRUE;
-}
+/* engine types by engine name, registered on first use */
+static GHashTable *engine_types = NULL;
 
 GType
 ibus_m17n_engine_get_type_for_name (const gchar *engine_name)
 {
     GType type;
     gchar *type_name, *lang = NULL, *name = NULL;
+    IBusM17NEngineClassData *class_data;
 
     GTypeInfo type_info = {
         sizeof (IBusM17NEngineClass),
@@ -252,16 +469,30 @@ ibus_m17n_engine_get_type_for_name (const gchar *engine_name)
         (GInstanceInitFunc)    ibus_m17n_engine_init,
     };
 
+    if (engine_types == NULL)
+        engine_types = g_hash_table_new (g_str_hash, g_str_equal);
+
+    type = GPOINTER_TO_SIZE (g_hash_table_lookup (engine_types, engine_name));
+    if (type != 0)
+        return type;
+
     if (!ibus_m17n_scan_engine_name (engine_name, &lang, &name)) {
         g_free (lang);
         g_free (name);
         return G_TYPE_INVALID;
     }
-    lang[0] = g_ascii_toupper (lang[0]);
-    name[0] = g_ascii_toupper (name[0]);
-    type_name = g_strdup_printf ("IBusM17N%s%sEngine", lang, name);
-    g_free (lang);
-    g_free (name);
+
+    /* the class data lives as long as the type, which is never
+       unregistered from the module */
+    class_data = g_slice_new (IBusM17NEngineClassData);
+    class_data->engine_name = g_strdup (engine_name);
+    class_data->lang = lang;
+    class_data->name = name;
+    type_info.class_data = class_data;
+
+    type_name = g_strdup_printf ("IBusM17N%c%s%c%sEngine",
+                                 g_ascii_toupper (lang[0]), lang + 1,
+                                 g_ascii_toupper (name[0]), name + 1);
 
     type = g_type_from_name (type_name);
     g_assert (type == 0 || g_type_is_a (type, IBUS_TYPE_ENGINE));
@@ -275,18 +506,20 @@ ibus_m17n_engine_get_type_for_name (const gchar *engine_name)
     }
     g_free (type_name);
 
+    g_hash_table_insert (engine_types, class_data->engine_name,
+                         GSIZE_TO_POINTER (type));
+
     return type;
 }
 
 static void
-ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
+ibus_m17n_engine_class_init (IBusM17NEngineClass     *klass,
+                             IBusM17NEngineClassData *class_data)
 {
     GObjectClass *object_class = G_OBJECT_CLASS (klass);
     IBusObjectClass *ibus_object_class = IBUS_OBJECT_CLASS (klass);
     IBusEngineClass *engine_class = IBUS_ENGINE_CLASS (klass);
-    gchar *engine_name, *lang = NULL, *name = NULL;
-    IBusM17NEngineConfig *engine_config;
-    gchar *hex;
+    const gchar *engine_name = class_data->engine_name;
 
     if (parent_class == NULL)
         parent_class = (IBusEngineClass *) g_type_class_peek_parent (klass);
@@ -311,25 +544,89 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
 
     engine_class->property_activate = ibus_m17n_engine_property_activate;
 
-    if (!ibus_m17n_scan_class_name (G_OBJECT_CLASS_NAME (klass),
-                                    &lang, &name)) {
-        g_free (lang);
-        g_free (name);
+    klass->candidate_pages = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_queue_init (&klass->candidate_page_lru);
+
+    klass->config_section = g_strdup_printf ("engine/M17N/%s/%s",
+                                             class_data->lang,
+                                             class_data->name);
+    if (engine_classes == NULL)
+        engine_classes = g_hash_table_new (g_str_hash, g_str_equal);
+    g_hash_table_insert (engine_classes, klass->config_section, klass);
+
+    /* configurations are per class */
+    klass->engine_name = engine_name;
+    ibus_m17n_engine_class_set_defaults (klass);
+
+    if (ibus_m17n_stats_is_enabled ())
+        klass->stats = ibus_m17n_stats_new (engine_name);
+
+    klass->im_lang = msymbol (class_data->lang);
+    klass->im_name = msymbol (class_data->name);
+    klass->im = NULL;
+
+#if IBUS_CHECK_VERSION(1,4,0)
+    /* the engines start with the values of the previous run, or the
+       defaults, and get the configured values when the config service
+       replies */
+    if (config) {
+        IBusM17NUIConfig ui_config;
+
+        if (ibus_m17n_ui_config_lookup (engine_name, &ui_config)) {
+            klass->preedit_foreground = ui_config.preedit_foreground;
+            klass->preedit_background = ui_config.preedit_background;
+            klass->preedit_underline = ui_config.preedit_underline;
+            klass->lookup_table_orientation = ui_config.lookup_table_orientation;
+        }
+
+        ibus_config_get_values_async (config,
+                                      klass->config_section,
+                                      -1,
+                                      NULL,
+                                      ibus_m17n_engine_class_config_cb,
+                                      GSIZE_TO_POINTER (G_TYPE_FROM_CLASS (klass)));
         return;
     }
-    engine_name = g_strdup_printf ("m17n:%s:%s", lang, name);
-    klass->config_section = g_strdup_printf ("engine/M17N/%s/%s", lang, name);
-    g_free (lang);
-    g_free (name);
+#endif  /* IBUS_CHECK_VERSION(1,4,0) */
+    ibus_m17n_engine_class_load_config (klass);
+}
 
-    /* configurations are per class */
-    klass->preedit_foreground = INVALID_COLOR;
-    klass->preedit_background = INVALID_COLOR;
+/* Saves the configurations of klass for the next run. */
+static void
+ibus_m17n_engine_class_save_ui_config (IBusM17NEngineClass *klass)
+{
+    IBusM17NUIConfig ui_config;
+
+    ui_config.preedit_foreground = klass->preedit_foreground;
+    ui_config.preedit_background = klass->preedit_background;
+    ui_config.preedit_underline = klass->preedit_underline;
+    ui_config.lookup_table_orientation = klass->lookup_table_orientation;
+    ibus_m17n_ui_config_update (klass->engine_name, &ui_config);
+}
+
+/* Sets the configurations of klass to the defaults of default.xml. */
+static void
+ibus_m17n_engine_class_set_defaults (IBusM17NEngineClass *klass)
+{
+    IBusM17NEngineConfig *engine_config;
+
+    engine_config = ibus_m17n_get_engine_config (klass->engine_name);
+    if (engine_config && engine_config->preedit_highlight) {
+        klass->preedit_foreground = PREEDIT_FOREGROUND;
+        klass->preedit_background = PREEDIT_BACKGROUND;
+    } else {
+        klass->preedit_foreground = INVALID_COLOR;
+        klass->preedit_background = INVALID_COLOR;
+    }
     klass->preedit_underline = IBUS_ATTR_UNDERLINE_NONE;
     klass->lookup_table_orientation = IBUS_ORIENTATION_SYSTEM;
+}
 
-    engine_config = ibus_m17n_get_engine_config (engine_name);
-    g_free (engine_name);
+/* Overrides the defaults of klass with the configured values. */
+static void
+ibus_m17n_engine_class_load_config (IBusM17NEngineClass *klass)
+{
+    gchar *hex;
 
     if (ibus_m17n_config_get_string (config,
                                      klass->config_section,
@@ -337,8 +634,7 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
                                      &hex)) {
         klass->preedit_foreground = ibus_m17n_parse_color (hex);
         g_free (hex);
-    } else if (engine_config->preedit_highlight)
-        klass->preedit_foreground = PREEDIT_FOREGROUND;
+    }
 
     if (ibus_m17n_config_get_string (config,
                                      klass->config_section,
@@ -346,27 +642,52 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
                                      &hex)) {
         klass->preedit_background = ibus_m17n_parse_color (hex);
         g_free (hex);
-    } else if (engine_config->preedit_highlight)
-        klass->preedit_background = PREEDIT_BACKGROUND;
+    }
 
-    if (!ibus_m17n_config_get_int (config,
-                                   klass->config_section,
-                                   "preedit_underline",
-                                   &klass->preedit_underline))
-        klass->preedit_underline = IBUS_ATTR_UNDERLINE_NONE;
+    ibus_m17n_config_get_int (config,
+                              klass->config_section,
+                              "preedit_underline",
+                              &klass->preedit_underline);
 
-    if (!ibus_m17n_config_get_int (config,
-                                   klass->config_section,
-                                   "lookup_table_orientation",
-                                   &klass->lookup_table_orientation))
-        klass->lookup_table_orientation = IBUS_ORIENTATION_SYSTEM;
+    ibus_m17n_config_get_int (config,
+                              klass->config_section,
+                              "lookup_table_orientation",
+                              &klass->lookup_table_orientation);
 
-    g_signal_connect (config, "value-changed",
-                      G_CALLBACK(ibus_m17n_config_value_changed),
-                      klass);
+    ibus_m17n_engine_class_save_ui_config (klass);
+}
 
-    klass->im = NULL;
+#if IBUS_CHECK_VERSION(1,4,0)
+static void
+ibus_m17n_engine_class_config_cb (GObject      *source,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+    IBusM17NEngineClass *klass;
+    GVariant *dict;
+    GError *error = NULL;
+
+    dict = ibus_config_get_values_async_finish (IBUS_CONFIG (source),
+                                                result,
+                                                &error);
+    if (dict == NULL) {
+        g_debug ("Can not read config: %s", error->message);
+        g_error_free (error);
+        return;
+    }
+
+    /* the class may have been finalized meanwhile */
+    klass = g_type_class_peek (GPOINTER_TO_SIZE (user_data));
+    if (klass) {
+        /* the snapshot values are replaced, including those the config
+           service does not have */
+        ibus_m17n_config_cache_add_section (klass->config_section, dict);
+        ibus_m17n_engine_class_set_defaults (klass);
+        ibus_m17n_engine_class_load_config (klass);
+    }
+    g_variant_unref (dict);
 }
+#endif  /* IBUS_CHECK_VERSION(1,4,0) */
 
 #if IBUS_CHECK_VERSION(1,3,99)
 #define _g_variant_get_string g_variant_get_string
@@ -376,6 +697,61 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
 #define _g_variant_get_int32 g_value_get_int
 #endif  /* !IBUS_CHECK_VERSION(1,3,99) */
 
+#if IBUS_CHECK_VERSION(1,3,99)
+typedef GVariant IBusM17NConfigValue;
+#else
+typedef GValue IBusM17NConfigValue;
+#endif  /* !IBUS_CHECK_VERSION(1,3,99) */
+
+typedef void (*IBusM17NConfigSetter) (IBusM17NEngineClass *klass,
+                                      IBusM17NConfigValue *value);
+
+static void
+ibus_m17n_config_set_preedit_foreground (IBusM17NEngineClass *klass,
+                                         IBusM17NConfigValue *value)
+{
+    guint color = ibus_m17n_parse_color (_g_variant_get_string (value, NULL));
+
+    if (color != INVALID_COLOR)
+        klass->preedit_foreground = color;
+}
+
+static void
+ibus_m17n_config_set_preedit_background (IBusM17NEngineClass *klass,
+                                         IBusM17NConfigValue *value)
+{
+    guint color = ibus_m17n_parse_color (_g_variant_get_string (value, NULL));
+
+    if (color != INVALID_COLOR)
+        klass->preedit_background = color;
+}
+
+static void
+ibus_m17n_config_set_preedit_underline (IBusM17NEngineClass *klass,
+                                        IBusM17NConfigValue *value)
+{
+    klass->preedit_underline = _g_variant_get_int32 (value);
+}
+
+static void
+ibus_m17n_config_set_lookup_table_orientation (IBusM17NEngineClass *klass,
+                                               IBusM17NConfigValue *value)
+{
+    klass->lookup_table_orientation = _g_variant_get_int32 (value);
+}
+
+static const struct {
+    const gchar *name;
+    IBusM17NConfigSetter setter;
+} config_setter_entries[] = {
+    { "preedit_foreground", ibus_m17n_config_set_preedit_foreground },
+    { "preedit_background", ibus_m17n_config_set_preedit_background },
+    { "preedit_underline", ibus_m17n_config_set_preedit_underline },
+    { "lookup_table_orientation", ibus_m17n_config_set_lookup_table_orientation },
+};
+
+/* The only value-changed handler; it looks up the class owning the
+   section and the setter of the key, whatever the number of classes. */
 static void
 ibus_m17n_config_value_changed (IBusConfig          *config,
                                 const gchar         *section,
@@ -385,36 +761,68 @@ ibus_m17n_config_value_changed (IBusConfig          *config,
 #else
                                 GValue              *value,
 #endif  /* !IBUS_CHECK_VERSION(1,3,99) */
-                                IBusM17NEngineClass *klass)
-{
-    if (g_strcmp0 (section, klass->config_section) == 0) {
-        if (g_strcmp0 (name, "preedit_foreground") == 0) {
-            const gchar *hex = _g_variant_get_string (value, NULL);
-            guint color;
-            color = ibus_m17n_parse_color (hex);
-            if (color != INVALID_COLOR) {
-                klass->preedit_foreground = color;
-            }
-        } else if (g_strcmp0 (name, "preedit_background") == 0) {
-            const gchar *hex = _g_variant_get_string (value, NULL);
-            guint color;
-            color = ibus_m17n_parse_color (hex);
-            if (color != INVALID_COLOR) {
-                klass->preedit_background = color;
-            }
-        } else if (g_strcmp0 (name, "preedit_underline") == 0) {
-            klass->preedit_underline = _g_variant_get_int32 (value);
-        } else if (g_strcmp0 (name, "lookup_table_orientation") == 0) {
-            klass->lookup_table_orientation = _g_variant_get_int32 (value);
-        }
+                                gpointer             user_data)
+{
+    IBusM17NEngineClass *klass;
+    IBusM17NConfigSetter setter;
+
+#if IBUS_CHECK_VERSION(1,3,99)
+    ibus_m17n_config_cache_update (section, name, value);
+#endif  /* IBUS_CHECK_VERSION(1,3,99) */
+
+    if (engine_classes == NULL || value == NULL)
+        return;
+
+    klass = g_hash_table_lookup (engine_classes, section);
+    if (klass == NULL)
+        return;
+
+    if (config_setters == NULL) {
+        gint i;
+
+        config_setters = g_hash_table_new (g_str_hash, g_str_equal);
+        for (i = 0; i < G_N_ELEMENTS (config_setter_entries); i++)
+            g_hash_table_insert (config_setters,
+                                 (gpointer) config_setter_entries[i].name,
+                                 config_setter_entries[i].setter);
     }
+
+    setter = g_hash_table_lookup (config_setters, name);
+    if (setter) {
+        setter (klass, value);
+        ibus_m17n_engine_class_save_ui_config (klass);
+    }
+}
+
+static void
+ibus_m17n_candidate_page_free (IBusM17NCandidatePage *page)
+{
+    g_ptr_array_foreach (page->candidates, (GFunc) g_object_unref, NULL);
+    g_ptr_array_free (page->candidates, TRUE);
+    m17n_object_unref (page->group);
+    g_slice_free (IBusM17NCandidatePage, page);
+}
+
+static void
+ibus_m17n_engine_class_clear_candidate_pages (IBusM17NEngineClass *klass)
+{
+    IBusM17NCandidatePage *page;
+
+    while ((page = g_queue_pop_head (&klass->candidate_page_lru)) != NULL)
+        ibus_m17n_candidate_page_free (page);
+    g_hash_table_remove_all (klass->candidate_pages);
 }
 
 static void
 ibus_m17n_engine_class_finalize (IBusM17NEngineClass *klass)
 {
+    ibus_m17n_engine_class_clear_candidate_pages (klass);
+    g_hash_table_destroy (klass->candidate_pages);
+
     if (klass->im)
         minput_close_im (klass->im);
+    if (engine_classes)
+        g_hash_table_remove (engine_classes, klass->config_section);
     g_free (klass->config_section);
 }
 
@@ -458,123 +866,667 @@ ibus_m17n_engine_init (IBusM17NEngine *m17n)
     m17n->table = ibus_lookup_table_new (9, 0, TRUE, TRUE);
     g_object_ref_sink (m17n->table);
     m17n->context = NULL;
+    m17n->idle = TRUE;
+    g_queue_init (&m17n->queued_events);
+
+    m17n->produced = mtext ();
+    m17n->preedit.valid = FALSE;
+    m17n->preedit.text = mtext ();
+    memset (&m17n->pending, 0, sizeof (m17n->pending));
+    memset (&m17n->lookup, 0, sizeof (m17n->lookup));
+    ibus_m17n_arena_init (&m17n->arena, ARENA_INITIAL_SIZE);
 }
 
-static GObject*
-ibus_m17n_engine_constructor (GType                   type,
-                              guint                   n_construct_params,
-                              GObjectConstructParam  *construct_params)
+#define MAX_INCLUDE_DEPTH 8
+
+static gboolean ibus_m17n_consumable_keys_add_im
+                                            (guint32        *keys,
+                                             MSymbol         lang,
+                                             MSymbol         name,
+                                             MSymbol         extra,
+                                             gint            depth);
+
+static void
+ibus_m17n_consumable_keys_add_char (guint32 *keys,
+                                    gint     c)
 {
-    IBusM17NEngine *m17n;
-    GObjectClass *object_class;
-    IBusM17NEngineClass *klass;
+    if (c > 0 && c < 128)
+        keys[c >> 5] |= 1U << (c & 31);
+}
 
-    m17n = (IBusM17NEngine *) G_OBJECT_CLASS (parent_class)->constructor (type,
-                                                       n_construct_params,
-                                                       construct_params);
+/* Marks the character a key symbol stands for, and for symbols with
+   modifiers like "S-a" or "C-a" the base character in both cases, since
+   m17n-lib may canonicalize them to a plain character. */
+static void
+ibus_m17n_consumable_keys_add_symbol (guint32 *keys,
+                                      MSymbol  symbol)
+{
+    const gchar *name = msymbol_name (symbol);
+    gsize len = strlen (name);
 
-    object_class = G_OBJECT_GET_CLASS (m17n);
-    klass = (IBusM17NEngineClass *) object_class;
-    if (klass->im == NULL) {
-        const gchar *engine_name;
-        gchar *lang = NULL, *name = NULL;
+    if (len == 1) {
+        ibus_m17n_consumable_keys_add_char (keys, name[0]);
+    }
+    else if (len > 2 && name[len - 2] == '-') {
+        ibus_m17n_consumable_keys_add_char (keys, g_ascii_tolower (name[len - 1]));
+        ibus_m17n_consumable_keys_add_char (keys, g_ascii_toupper (name[len - 1]));
+    }
+    else if (g_strcmp0 (name, "space") == 0) {
+        ibus_m17n_consumable_keys_add_char (keys, IBUS_space);
+    }
+}
 
-        engine_name = ibus_engine_get_name ((IBusEngine *) m17n);
-        if (!ibus_m17n_scan_engine_name (engine_name, &lang, &name)) {
-            g_free (lang);
-            g_free (name);
-            return NULL;
-        }
+/* KEYSEQ ::= MTEXT | '(' [ SYMBOL | INTEGER ] * ')' */
+static gboolean
+ibus_m17n_consumable_keys_add_keyseq (guint32 *keys,
+                                      MPlist  *keyseq)
+{
+    MPlist *p;
 
-        klass->im = minput_open_im (msymbol (lang), msymbol (name), NULL);
-        g_free (lang);
-        g_free (name);
+    if (mplist_key (keyseq) == Mtext) {
+        MText *mt = (MText *) mplist_value (keyseq);
+        gint i;
 
-        if (klass->im == NULL) {
-            g_warning ("Can not find m17n keymap %s", engine_name);
-            g_object_unref (m17n);
-            return NULL;
-        }
+        for (i = 0; i < mtext_len (mt); i++)
+            ibus_m17n_consumable_keys_add_char (keys, mtext_ref_char (mt, i));
+        return TRUE;
+    }
 
-        mplist_put (klass->im->driver.callback_list, Minput_preedit_start, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_preedit_draw, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_preedit_done, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_status_start, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_status_draw, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_status_done, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_candidates_start, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_candidates_draw, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_candidates_done, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_set_spot, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_toggle, ibus_m17n_engine_callback);
-        /*
-          Does not set reset callback, uses the default callback in m17n.
-          mplist_put (klass->im->driver.callback_list, Minput_reset, ibus_m17n_engine_callback);
-        */
-        mplist_put (klass->im->driver.callback_list, Minput_get_surrounding_text, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_delete_surrounding_text, ibus_m17n_engine_callback);
-    }
-
-    m17n->context = minput_create_ic (klass->im, m17n);
+    if (mplist_key (keyseq) != Mplist)
+        return FALSE;
 
-    return (GObject *) m17n;
+    for (p = mplist_value (keyseq); mplist_key (p) != Mnil; p = mplist_next (p)) {
+        if (mplist_key (p) == Msymbol)
+            ibus_m17n_consumable_keys_add_symbol (keys, mplist_value (p));
+        else if (mplist_key (p) == Minteger)
+            ibus_m17n_consumable_keys_add_char (keys, (gint) (long) mplist_value (p));
+        else
+            return FALSE;
+    }
+    return TRUE;
 }
 
-static void
-ibus_m17n_engine_destroy (IBusM17NEngine *m17n)
+/* (include (LANG NAME [EXTRA]) ...) */
+static gboolean
+ibus_m17n_consumable_keys_add_include (guint32 *keys,
+                                       MPlist  *plist,
+                                       gint     depth)
 {
-    if (m17n->prop_list) {
-        g_object_unref (m17n->prop_list);
-        m17n->prop_list = NULL;
-    }
+    MPlist *tags;
+    MSymbol lang, name, extra = Mnil;
 
-    if (m17n->status_prop) {
-        g_object_unref (m17n->status_prop);
-        m17n->status_prop = NULL;
-    }
+    plist = mplist_next (plist);
+    if (mplist_key (plist) != Mplist)
+        return FALSE;
 
-#if HAVE_SETUP
-    if (m17n->setup_prop) {
-        g_object_unref (m17n->setup_prop);
-        m17n->setup_prop = NULL;
-    }
-#endif  /* HAVE_SETUP */
+    tags = mplist_value (plist);
+    if (mplist_key (tags) != Msymbol)
+        return FALSE;
+    lang = mplist_value (tags);
 
-    if (m17n->table) {
-        g_object_unref (m17n->table);
-        m17n->table = NULL;
-    }
+    tags = mplist_next (tags);
+    if (mplist_key (tags) != Msymbol)
+        return FALSE;
+    name = mplist_value (tags);
 
-    if (m17n->context) {
-        minput_destroy_ic (m17n->context);
-        m17n->context = NULL;
-    }
+    tags = mplist_next (tags);
+    if (mplist_key (tags) == Msymbol)
+        extra = mplist_value (tags);
 
-    IBUS_OBJECT_CLASS (parent_class)->destroy ((IBusObject *)m17n);
+    return ibus_m17n_consumable_keys_add_im (keys, lang, name, extra, depth + 1);
 }
 
-static void
-ibus_m17n_engine_update_preedit (IBusM17NEngine *m17n)
+static gboolean
+ibus_m17n_is_include (MPlist *plist)
 {
-    IBusText *text;
-    gchar *buf;
-    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    return mplist_key (plist) == Msymbol &&
+        mplist_value (plist) == msymbol ("include");
+}
 
-    buf = ibus_m17n_mtext_to_utf8 (m17n->context->preedit);
-    if (buf) {
-        text = ibus_text_new_from_static_string (buf);
-        if (klass->preedit_foreground != INVALID_COLOR)
-            ibus_text_append_attribute (text, IBUS_ATTR_TYPE_FOREGROUND,
-                                        klass->preedit_foreground, 0, -1);
-        if (klass->preedit_background != INVALID_COLOR)
-            ibus_text_append_attribute (text, IBUS_ATTR_TYPE_BACKGROUND,
-                                        klass->preedit_background, 0, -1);
-        ibus_text_append_attribute (text, IBUS_ATTR_TYPE_UNDERLINE,
-                                    klass->preedit_underline, 0, -1);
-        ibus_engine_update_preedit_text ((IBusEngine *) m17n,
-                                         text,
-                                         m17n->context->cursor_pos,
-                                         mtext_len (m17n->context->preedit) > 0);
+/* (map (MAP-NAME RULE ...) ...), RULE ::= '(' KEYSEQ MAP-ACTION * ')' */
+static gboolean
+ibus_m17n_consumable_keys_add_maps (guint32 *keys,
+                                    MPlist  *maps,
+                                    gint     depth)
+{
+    for (; mplist_key (maps) != Mnil; maps = mplist_next (maps)) {
+        MPlist *rule;
+
+        if (mplist_key (maps) != Mplist)
+            return FALSE;
+
+        rule = mplist_value (maps);
+        if (ibus_m17n_is_include (rule)) {
+            if (!ibus_m17n_consumable_keys_add_include (keys, rule, depth))
+                return FALSE;
+            continue;
+        }
+
+        for (rule = mplist_next (rule); mplist_key (rule) != Mnil; rule = mplist_next (rule)) {
+            MPlist *keyseq;
+
+            if (mplist_key (rule) != Mplist)
+                return FALSE;
+
+            keyseq = mplist_value (rule);
+            if (ibus_m17n_is_include (keyseq)) {
+                if (!ibus_m17n_consumable_keys_add_include (keys, keyseq, depth))
+                    return FALSE;
+            }
+            else if (!ibus_m17n_consumable_keys_add_keyseq (keys, keyseq))
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* (state (STATE-NAME [TITLE] (MAP-NAME BRANCH-ACTION *) ...) ...)
+
+   A branch for the map "nil" is taken for any key the other maps of the
+   state do not bind, so such an input method may consume every key. */
+static gboolean
+ibus_m17n_consumable_keys_check_states (guint32 *keys,
+                                        MPlist  *states,
+                                        gint     depth)
+{
+    for (; mplist_key (states) != Mnil; states = mplist_next (states)) {
+        MPlist *branch;
+
+        if (mplist_key (states) != Mplist)
+            return FALSE;
+
+        branch = mplist_value (states);
+        if (ibus_m17n_is_include (branch)) {
+            if (!ibus_m17n_consumable_keys_add_include (keys, branch, depth))
+                return FALSE;
+            continue;
+        }
+
+        for (branch = mplist_next (branch); mplist_key (branch) != Mnil; branch = mplist_next (branch)) {
+            MPlist *p;
+
+            if (mplist_key (branch) != Mplist)
+                continue;
+
+            p = mplist_value (branch);
+            if (mplist_key (p) == Msymbol && mplist_value (p) == Mnil)
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean
+ibus_m17n_consumable_keys_add_im (guint32 *keys,
+                                  MSymbol  lang,
+                                  MSymbol  name,
+                                  MSymbol  extra,
+                                  gint     depth)
+{
+    MDatabase *mdb;
+    MPlist *plist, *p;
+    gboolean retval = TRUE;
+
+    if (depth > MAX_INCLUDE_DEPTH)
+        return FALSE;
+
+    mdb = mdatabase_find (Minput_method, lang, name, extra);
+    if (mdb == NULL)
+        return FALSE;
+
+    plist = (MPlist *) mdatabase_load (mdb);
+    if (plist == NULL)
+        return FALSE;
+
+    for (p = plist; retval && mplist_key (p) != Mnil; p = mplist_next (p)) {
+        MPlist *elm;
+        MSymbol section;
+
+        if (mplist_key (p) != Mplist)
+            continue;
+
+        elm = mplist_value (p);
+        if (mplist_key (elm) != Msymbol)
+            continue;
+
+        section = mplist_value (elm);
+        if (section == msymbol ("map"))
+            retval = ibus_m17n_consumable_keys_add_maps (keys, mplist_next (elm), depth);
+        else if (section == msymbol ("state"))
+            retval = ibus_m17n_consumable_keys_check_states (keys, mplist_next (elm), depth);
+        else if (section == msymbol ("include"))
+            retval = ibus_m17n_consumable_keys_add_include (keys, elm, depth);
+    }
+
+    m17n_object_unref (plist);
+
+    return retval;
+}
+
+/* Each command is a plist (NAME DESCRIPTION STATUS KEYSEQ ...). */
+static gboolean
+ibus_m17n_consumable_keys_add_commands (guint32 *keys,
+                                        MPlist  *commands)
+{
+    for (; commands && mplist_key (commands) != Mnil; commands = mplist_next (commands)) {
+        MPlist *p;
+        gint i;
+
+        if (mplist_key (commands) != Mplist)
+            return FALSE;
+
+        p = mplist_value (commands);
+        for (i = 0; i < 3 && mplist_key (p) != Mnil; i++)
+            p = mplist_next (p);
+
+        for (; mplist_key (p) != Mnil; p = mplist_next (p)) {
+            if (!ibus_m17n_consumable_keys_add_keyseq (keys, p))
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Collects the printable keys the input method of klass may ever
+   consume.  Anything the scan does not understand leaves the set
+   unknown, which disables the passthrough fast path for the class. */
+static void
+ibus_m17n_engine_class_scan_consumable_keys (IBusM17NEngineClass *klass)
+{
+    MSymbol lang = klass->im->language;
+    MSymbol name = klass->im->name;
+
+    memset (klass->consumable_keys, 0, sizeof (klass->consumable_keys));
+    klass->consumable_keys_known =
+        ibus_m17n_consumable_keys_add_im (klass->consumable_keys,
+                                          lang, name, Mnil, 0) &&
+        ibus_m17n_consumable_keys_add_commands (klass->consumable_keys,
+                                                minput_get_command (lang, name, Mnil)) &&
+        ibus_m17n_consumable_keys_add_commands (klass->consumable_keys,
+                                                minput_get_command (Mt, Mnil, Mnil));
+}
+
+/* Opens the input method of the class and installs the callbacks. */
+static gboolean
+ibus_m17n_engine_class_open_im (IBusM17NEngineClass *klass)
+{
+    klass->im = minput_open_im (klass->im_lang, klass->im_name, NULL);
+
+    if (klass->im == NULL) {
+        g_warning ("Can not find m17n keymap %s", klass->engine_name);
+        return FALSE;
+    }
+
+    mplist_put (klass->im->driver.callback_list, Minput_preedit_start, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_preedit_draw, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_preedit_done, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_status_start, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_status_draw, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_status_done, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_candidates_start, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_candidates_draw, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_candidates_done, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_set_spot, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_toggle, ibus_m17n_engine_callback);
+    /*
+      Does not set reset callback, uses the default callback in m17n.
+      mplist_put (klass->im->driver.callback_list, Minput_reset, ibus_m17n_engine_callback);
+    */
+    mplist_put (klass->im->driver.callback_list, Minput_get_surrounding_text, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_delete_surrounding_text, ibus_m17n_engine_callback);
+
+    ibus_m17n_engine_class_scan_consumable_keys (klass);
+    klass->im_config_hash = ibus_m17n_engine_class_config_hash (klass);
+
+    return TRUE;
+}
+
+static gchar *
+ibus_m17n_mru_filename (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "ibus-m17n", "mru", NULL);
+}
+
+/* Returns the recently used engine names, most recent first. */
+static gchar **
+ibus_m17n_mru_load (void)
+{
+    gchar *filename, *contents = NULL;
+    gchar **names;
+
+    filename = ibus_m17n_mru_filename ();
+    if (!g_file_get_contents (filename, &contents, NULL, NULL)) {
+        g_free (filename);
+        return g_new0 (gchar *, 1);
+    }
+    g_free (filename);
+
+    names = g_strsplit (g_strstrip (contents), "\n", MRU_SIZE + 1);
+    g_free (contents);
+    return names;
+}
+
+/* recently used engine names, most recent first, read on first use and
+   written back from a timeout */
+static gchar **mru = NULL;
+static guint mru_save_id = 0;
+
+static gchar **
+ibus_m17n_mru_get (void)
+{
+    if (mru == NULL)
+        mru = ibus_m17n_mru_load ();
+    return mru;
+}
+
+static void
+ibus_m17n_mru_save (void)
+{
+    gchar *filename, *dirname;
+    GString *contents;
+    gchar **p;
+
+    contents = g_string_new (NULL);
+    for (p = ibus_m17n_mru_get (); *p != NULL; p++) {
+        g_string_append (contents, *p);
+        g_string_append_c (contents, '\n');
+    }
+
+    filename = ibus_m17n_mru_filename ();
+    dirname = g_path_get_dirname (filename);
+    g_mkdir_with_parents (dirname, 0700);
+    g_file_set_contents (filename, contents->str, contents->len, NULL);
+    g_free (dirname);
+    g_free (filename);
+    g_string_free (contents, TRUE);
+}
+
+static gboolean
+ibus_m17n_mru_save_cb (gpointer user_data)
+{
+    mru_save_id = 0;
+    ibus_m17n_mru_save ();
+    return FALSE;
+}
+
+static void
+ibus_m17n_mru_add (const gchar *engine_name)
+{
+    GPtrArray *names;
+    gchar **p;
+
+    p = ibus_m17n_mru_get ();
+    if (g_strcmp0 (p[0], engine_name) == 0)
+        return;
+
+    names = g_ptr_array_new ();
+    g_ptr_array_add (names, g_strdup (engine_name));
+    for (; *p != NULL && names->len < MRU_SIZE; p++) {
+        if (**p == '\0' || strcmp (*p, engine_name) == 0)
+            continue;
+        g_ptr_array_add (names, g_strdup (*p));
+    }
+    g_ptr_array_add (names, NULL);
+
+    g_strfreev (mru);
+    mru = (gchar **) g_ptr_array_free (names, FALSE);
+
+    /* keep disk writes off the engine creation path */
+    if (mru_save_id == 0)
+        mru_save_id = g_timeout_add_seconds (MRU_SAVE_DELAY,
+                                             ibus_m17n_mru_save_cb,
+                                             NULL);
+}
+
+void
+ibus_m17n_engine_save_recent (void)
+{
+    if (mru_save_id == 0)
+        return;
+
+    g_source_remove (mru_save_id);
+    mru_save_id = 0;
+    ibus_m17n_mru_save ();
+}
+
+static gboolean
+ibus_m17n_engine_preload_cb (GQueue *names)
+{
+    gchar *engine_name;
+    GType type;
+
+    engine_name = g_queue_pop_head (names);
+    type = ibus_m17n_engine_get_type_for_name (engine_name);
+    if (type != G_TYPE_INVALID) {
+        /* the class reference is kept, so the input method stays open */
+        IBusM17NEngineClass *klass = g_type_class_ref (type);
+
+        if (klass->im == NULL)
+            ibus_m17n_engine_class_open_im (klass);
+    }
+    g_free (engine_name);
+
+    if (g_queue_is_empty (names)) {
+        g_queue_free (names);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void
+ibus_m17n_engine_preload_recent (void)
+{
+    GQueue *names = g_queue_new ();
+    gchar **p;
+
+    for (p = ibus_m17n_mru_get (); *p != NULL; p++) {
+        if (**p != '\0')
+            g_queue_push_tail (names, g_strdup (*p));
+    }
+
+    if (g_queue_is_empty (names)) {
+        g_queue_free (names);
+        return;
+    }
+
+    /* one input method per idle callback, to keep serving the bus */
+    g_idle_add_full (G_PRIORITY_LOW,
+                     (GSourceFunc) ibus_m17n_engine_preload_cb,
+                     names,
+                     NULL);
+}
+
+static GObject*
+ibus_m17n_engine_constructor (GType                   type,
+                              guint                   n_construct_params,
+                              GObjectConstructParam  *construct_params)
+{
+    IBusM17NEngine *m17n;
+    GObjectClass *object_class;
+    IBusM17NEngineClass *klass;
+    const gchar *engine_name;
+
+    m17n = (IBusM17NEngine *) G_OBJECT_CLASS (parent_class)->constructor (type,
+                                                       n_construct_params,
+                                                       construct_params);
+
+    object_class = G_OBJECT_GET_CLASS (m17n);
+    klass = (IBusM17NEngineClass *) object_class;
+    engine_name = ibus_engine_get_name ((IBusEngine *) m17n);
+    if (klass->im == NULL &&
+        mdatabase_find (Minput_method, klass->im_lang, klass->im_name, Mnil) == NULL) {
+        g_warning ("Can not find m17n keymap %s", engine_name);
+        g_object_unref (m17n);
+        return NULL;
+    }
+
+    ibus_m17n_mru_add (engine_name);
+    m17n->trace_engine = ibus_m17n_key_trace_add_engine (engine_name);
+    klass->engines = g_slist_prepend (klass->engines, m17n);
+
+    if (klass->im) {
+        m17n->context = minput_create_ic (klass->im, m17n);
+        return (GObject *) m17n;
+    }
+
+    /* Loading an input method may take long.  It is done in an idle
+       callback so that ibus-daemon gets the new engine first, but it still
+       runs on the main loop and holds up all the other engines meanwhile:
+       m17n-lib is not thread safe. */
+    klass->waiting_engines = g_slist_prepend (klass->waiting_engines, m17n);
+    if (klass->open_im_id == 0)
+        klass->open_im_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                                             (GSourceFunc) ibus_m17n_engine_class_open_im_cb,
+                                             g_type_class_ref (type),
+                                             (GDestroyNotify) g_type_class_unref);
+
+    return (GObject *) m17n;
+}
+
+static void
+ibus_m17n_engine_destroy (IBusM17NEngine *m17n)
+{
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    IBusM17NQueuedEvent *queued;
+
+    klass->waiting_engines = g_slist_remove (klass->waiting_engines, m17n);
+    klass->engines = g_slist_remove (klass->engines, m17n);
+    while ((queued = g_queue_pop_head (&m17n->queued_events)) != NULL)
+        g_slice_free (IBusM17NQueuedEvent, queued);
+
+    if (m17n->prop_list) {
+        g_object_unref (m17n->prop_list);
+        m17n->prop_list = NULL;
+    }
+
+    if (m17n->status_prop) {
+        g_object_unref (m17n->status_prop);
+        m17n->status_prop = NULL;
+    }
+
+#if HAVE_SETUP
+    if (m17n->setup_prop) {
+        g_object_unref (m17n->setup_prop);
+        m17n->setup_prop = NULL;
+    }
+#endif  /* HAVE_SETUP */
+
+    if (m17n->table) {
+        g_object_unref (m17n->table);
+        m17n->table = NULL;
+    }
+
+    if (m17n->context) {
+        minput_destroy_ic (m17n->context);
+        m17n->context = NULL;
+    }
+
+    if (m17n->produced) {
+        m17n_object_unref (m17n->produced);
+        m17n->produced = NULL;
+    }
+
+    if (m17n->preedit.text) {
+        m17n_object_unref (m17n->preedit.text);
+        m17n->preedit.text = NULL;
+    }
+
+    if (m17n->lookup.candidate_list) {
+        m17n_object_unref (m17n->lookup.candidate_list);
+        m17n->lookup.candidate_list = NULL;
+    }
+
+    ibus_m17n_arena_clear (&m17n->arena);
+
+    IBUS_OBJECT_CLASS (parent_class)->destroy ((IBusObject *)m17n);
+}
+
+/* Converts text into memory from the engine's arena, which stays valid
+   until the end of the current key event. */
+static gchar *
+ibus_m17n_engine_mtext_to_utf8 (IBusM17NEngine *m17n,
+                                MText          *text)
+{
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    gint64 start = 0;
+    gsize bufsize;
+    gchar *buf;
+
+    if (text == NULL)
+        return NULL;
+
+    if (klass->stats)
+        start = g_get_monotonic_time ();
+
+    bufsize = ibus_m17n_mtext_utf8_len (text) + 1;
+    buf = ibus_m17n_arena_alloc (&m17n->arena, bufsize);
+    buf = ibus_m17n_mtext_to_utf8_buffer (text, buf, bufsize);
+
+    if (klass->stats)
+        m17n->convert_usec += g_get_monotonic_time () - start;
+
+    return buf;
+}
+
+static void
+ibus_m17n_engine_hide_preedit (IBusM17NEngine *m17n)
+{
+    if (m17n->preedit.valid && !m17n->preedit.visible)
+        return;
+
+    ibus_engine_hide_preedit_text ((IBusEngine *) m17n);
+    m17n->preedit.valid = TRUE;
+    m17n->preedit.visible = FALSE;
+}
+
+static void
+ibus_m17n_engine_update_preedit (IBusM17NEngine *m17n)
+{
+    IBusText *text;
+    gchar *buf;
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    IBusM17NPreeditState *state = &m17n->preedit;
+    MText *preedit = m17n->context->preedit;
+    gboolean visible = mtext_len (preedit) > 0;
+
+    /* an invisible preedit is always empty, so only the visibility of
+       the last update matters then */
+    if (state->valid && !visible && !state->visible)
+        return;
+
+    if (state->valid &&
+        visible == state->visible &&
+        m17n->context->cursor_pos == state->cursor_pos &&
+        klass->preedit_foreground == state->foreground &&
+        klass->preedit_background == state->background &&
+        klass->preedit_underline == state->underline &&
+        mtext_cmp (preedit, state->text) == 0)
+        return;
+
+    buf = ibus_m17n_engine_mtext_to_utf8 (m17n, preedit);
+    if (buf) {
+        text = ibus_text_new_from_static_string (buf);
+        if (klass->preedit_foreground != INVALID_COLOR)
+            ibus_text_append_attribute (text, IBUS_ATTR_TYPE_FOREGROUND,
+                                        klass->preedit_foreground, 0, -1);
+        if (klass->preedit_background != INVALID_COLOR)
+            ibus_text_append_attribute (text, IBUS_ATTR_TYPE_BACKGROUND,
+                                        klass->preedit_background, 0, -1);
+        ibus_text_append_attribute (text, IBUS_ATTR_TYPE_UNDERLINE,
+                                    klass->preedit_underline, 0, -1);
+        ibus_engine_update_preedit_text ((IBusEngine *) m17n,
+                                         text,
+                                         m17n->context->cursor_pos,
+                                         visible);
+
+        mtext_del (state->text, 0, mtext_len (state->text));
+        mtext_cat (state->text, preedit);
+        state->cursor_pos = m17n->context->cursor_pos;
+        state->visible = visible;
+        state->foreground = klass->preedit_foreground;
+        state->background = klass->preedit_background;
+        state->underline = klass->preedit_underline;
+        state->valid = TRUE;
     }
 }
 
@@ -582,10 +1534,243 @@ static void
 ibus_m17n_engine_commit_string (IBusM17NEngine *m17n,
                                 const gchar    *string)
 {
-    IBusText *text;
-    text = ibus_text_new_from_static_string (string);
-    ibus_engine_commit_text ((IBusEngine *)m17n, text);
-    ibus_m17n_engine_update_preedit (m17n);
+    m17n->pending.commit = string;
+    m17n->pending.preedit = TRUE;
+}
+
+static void
+ibus_m17n_engine_update_status (IBusM17NEngine *m17n)
+{
+    gchar *status;
+
+    status = ibus_m17n_engine_mtext_to_utf8 (m17n, m17n->context->status);
+
+    if (status && strlen (status)) {
+        IBusText *text;
+        text = ibus_text_new_from_string (status);
+        ibus_property_set_label (m17n->status_prop, text);
+        ibus_property_set_visible (m17n->status_prop, TRUE);
+    }
+    else {
+        ibus_property_set_label (m17n->status_prop, NULL);
+        ibus_property_set_visible (m17n->status_prop, FALSE);
+    }
+
+    ibus_engine_update_property ((IBusEngine *)m17n, m17n->status_prop);
+}
+
+/* Sends the final state of everything the callbacks marked as changed,
+   so that one key event results in at most one signal of each kind. */
+static void
+ibus_m17n_engine_flush (IBusM17NEngine *m17n)
+{
+    IBusM17NPendingUpdate *pending = &m17n->pending;
+
+    if (pending->commit) {
+        IBusText *text;
+
+        text = ibus_text_new_from_static_string (pending->commit);
+        ibus_engine_commit_text ((IBusEngine *)m17n, text);
+        pending->commit = NULL;
+
+        /* some clients drop a visible preedit on commit, so redraw it */
+        if (m17n->preedit.visible)
+            m17n->preedit.valid = FALSE;
+    }
+
+    if (pending->preedit) {
+        if (mtext_len (m17n->context->preedit) > 0)
+            ibus_m17n_engine_update_preedit (m17n);
+        else
+            ibus_m17n_engine_hide_preedit (m17n);
+        pending->preedit = FALSE;
+    }
+
+    if (pending->lookup_table) {
+        ibus_m17n_engine_update_lookup_table (m17n);
+        pending->lookup_table = FALSE;
+    }
+
+    if (pending->status) {
+        ibus_m17n_engine_update_status (m17n);
+        pending->status = FALSE;
+    }
+}
+
+/* Keyvals of a keyboard layout, resolved once per layout for every
+   keycode and every combination of the modifiers which select a level
+   when AltGr is stripped off (Shift, Lock and NumLock). */
+#define N_KEYMAP_KEYCODES 256
+#define N_KEYMAP_LEVELS 8
+
+typedef struct _IBusM17NKeymapCache IBusM17NKeymapCache;
+
+struct _IBusM17NKeymapCache {
+    gchar *layout;
+    guint keyvals[N_KEYMAP_KEYCODES][N_KEYMAP_LEVELS];
+};
+
+static GHashTable *keymap_caches = NULL;
+static IBusM17NKeymapCache *last_keymap_cache = NULL;
+
+static guint
+ibus_m17n_keymap_level (guint modifiers)
+{
+    guint level = 0;
+
+    if (modifiers & IBUS_SHIFT_MASK)
+        level |= 1;
+    if (modifiers & IBUS_LOCK_MASK)
+        level |= 2;
+    if (modifiers & IBUS_MOD2_MASK)
+        level |= 4;
+    return level;
+}
+
+static guint
+ibus_m17n_keymap_level_modifiers (guint level)
+{
+    guint modifiers = 0;
+
+    if (level & 1)
+        modifiers |= IBUS_SHIFT_MASK;
+    if (level & 2)
+        modifiers |= IBUS_LOCK_MASK;
+    if (level & 4)
+        modifiers |= IBUS_MOD2_MASK;
+    return modifiers;
+}
+
+static void
+ibus_m17n_keymap_cache_free (IBusM17NKeymapCache *cache)
+{
+    g_free (cache->layout);
+    g_slice_free (IBusM17NKeymapCache, cache);
+}
+
+static IBusM17NKeymapCache *
+ibus_m17n_keymap_cache_get (const gchar *layout)
+{
+    IBusM17NKeymapCache *cache;
+    IBusKeymap *keymap;
+    guint keycode, level;
+
+    if (last_keymap_cache != NULL &&
+        g_strcmp0 (last_keymap_cache->layout, layout) == 0)
+        return last_keymap_cache;
+
+    if (keymap_caches == NULL)
+        keymap_caches = g_hash_table_new_full (g_str_hash,
+                                               g_str_equal,
+                                               NULL,
+                                               (GDestroyNotify) ibus_m17n_keymap_cache_free);
+
+    cache = g_hash_table_lookup (keymap_caches, layout);
+    if (cache == NULL) {
+        keymap = ibus_keymap_get (layout);
+        if (keymap == NULL)
+            return NULL;
+
+        cache = g_slice_new (IBusM17NKeymapCache);
+        cache->layout = g_strdup (layout);
+        for (keycode = 0; keycode < N_KEYMAP_KEYCODES; keycode++) {
+            for (level = 0; level < N_KEYMAP_LEVELS; level++) {
+                cache->keyvals[keycode][level] =
+                    ibus_keymap_lookup_keysym (keymap, keycode,
+                                               ibus_m17n_keymap_level_modifiers (level));
+            }
+        }
+        g_object_unref (keymap);
+
+        g_hash_table_insert (keymap_caches, cache->layout, cache);
+    }
+
+    last_keymap_cache = cache;
+    return cache;
+}
+
+static guint
+ibus_m17n_keymap_lookup_keysym (const gchar *layout,
+                                guint        keycode,
+                                guint        modifiers)
+{
+    IBusM17NKeymapCache *cache;
+    IBusKeymap *keymap;
+    guint keyval;
+
+    if (keycode < N_KEYMAP_KEYCODES) {
+        cache = ibus_m17n_keymap_cache_get (layout);
+        if (cache != NULL)
+            return cache->keyvals[keycode][ibus_m17n_keymap_level (modifiers)];
+    }
+
+    keymap = ibus_keymap_get (layout);
+    if (keymap == NULL)
+        return IBUS_VoidSymbol;
+    keyval = ibus_keymap_lookup_keysym (keymap, keycode, modifiers);
+    g_object_unref (keymap);
+
+    return keyval;
+}
+
+/* Modifiers which may appear as a prefix of an m17n key symbol, in the
+   order m17n-lib expects them.  A set of these modifiers is packed into
+   a dense index so that translated symbols can be kept in small tables. */
+#define N_KEY_SYMBOL_MODIFIERS 7
+
+static const struct {
+    guint mask;
+    const gchar *prefix;
+} key_symbol_modifiers[N_KEY_SYMBOL_MODIFIERS] = {
+    { IBUS_SHIFT_MASK,   "S-" },
+    { IBUS_CONTROL_MASK, "C-" },
+    { IBUS_META_MASK,    "M-" },
+    { IBUS_MOD1_MASK,    "A-" },
+    { IBUS_MOD5_MASK,    "G-" },
+    { IBUS_SUPER_MASK,   "s-" },
+    { IBUS_HYPER_MASK,   "H-" },
+};
+
+/* Interned symbols for printable ASCII keyvals, filled on first use.
+   Symbols for all other keyvals are kept in key_symbols, keyed by
+   (keyval << N_KEY_SYMBOL_MODIFIERS | modifier index). */
+static MSymbol ascii_key_symbols[IBUS_asciitilde - IBUS_space + 1]
+                                [1 << N_KEY_SYMBOL_MODIFIERS];
+static GHashTable *key_symbols = NULL;
+
+static guint
+ibus_m17n_key_symbol_modifier_index (guint mask)
+{
+    guint index = 0;
+    gint i;
+
+    for (i = 0; i < N_KEY_SYMBOL_MODIFIERS; i++) {
+        if (mask & key_symbol_modifiers[i].mask)
+            index |= 1 << i;
+    }
+    return index;
+}
+
+static MSymbol
+ibus_m17n_key_symbol_new (const gchar *name,
+                          guint        mask)
+{
+    GString *keysym;
+    MSymbol mkeysym;
+    gint i;
+
+    keysym = g_string_new ("");
+
+    for (i = 0; i < N_KEY_SYMBOL_MODIFIERS; i++) {
+        if (mask & key_symbol_modifiers[i].mask)
+            g_string_append (keysym, key_symbol_modifiers[i].prefix);
+    }
+    g_string_append (keysym, name);
+
+    mkeysym = msymbol (keysym->str);
+    g_string_free (keysym, TRUE);
+
+    return mkeysym;
 }
 
 /* Note on AltGr (Level3 Shift) handling: While currently we expect
@@ -608,10 +1793,12 @@ ibus_m17n_key_event_to_symbol (guint keycode,
                                guint keyval,
                                guint modifiers)
 {
-    GString *keysym;
     MSymbol mkeysym = Mnil;
     guint mask = 0;
-    IBusKeymap *keymap;
+    guint index;
+    guint64 key, *stored_key;
+    gpointer value;
+    const gchar *name;
 
     if (keyval >= IBUS_Shift_L && keyval <= IBUS_Hyper_R) {
         return Mnil;
@@ -622,16 +1809,19 @@ ibus_m17n_key_event_to_symbol (guint keycode,
        represent the translated keyval as the form "G-<untranslated
        keyval>", which m17n-lib accepts. */
     if (modifiers & IBUS_MOD5_MASK) {
-        keymap = ibus_keymap_get ("us");
-        keyval = ibus_keymap_lookup_keysym (keymap, keycode,
-                                            modifiers & ~IBUS_MOD5_MASK);
-        g_object_unref (keymap);
+        keyval = ibus_m17n_keymap_lookup_keysym ("us", keycode,
+                                                 modifiers & ~IBUS_MOD5_MASK);
     }
 
-    keysym = g_string_new ("");
+    mask = modifiers & (IBUS_MOD1_MASK |
+                        IBUS_MOD5_MASK |
+                        IBUS_META_MASK |
+                        IBUS_SUPER_MASK |
+                        IBUS_HYPER_MASK);
 
     if (keyval >= IBUS_space && keyval <= IBUS_asciitilde) {
         gint c = keyval;
+        MSymbol *slot;
 
         if (keyval == IBUS_space && modifiers & IBUS_SHIFT_MASK)
             mask |= IBUS_SHIFT_MASK;
@@ -642,101 +1832,323 @@ ibus_m17n_key_event_to_symbol (guint keycode,
             mask |= IBUS_CONTROL_MASK;
         }
 
-        g_string_append_c (keysym, c);
-    }
-    else {
-        mask |= modifiers & (IBUS_CONTROL_MASK | IBUS_SHIFT_MASK);
-        g_string_append (keysym, ibus_keyval_name (keyval));
-        if (keysym->len == 0) {
-            g_string_free (keysym, TRUE);
-            return Mnil;
+        slot = &ascii_key_symbols[c - IBUS_space]
+                                 [ibus_m17n_key_symbol_modifier_index (mask)];
+        if (*slot == NULL) {
+            gchar buf[2] = { c, '\0' };
+            *slot = ibus_m17n_key_symbol_new (buf, mask);
         }
+        return *slot;
     }
 
-    mask |= modifiers & (IBUS_MOD1_MASK |
-                         IBUS_MOD5_MASK |
-                         IBUS_META_MASK |
-                         IBUS_SUPER_MASK |
-                         IBUS_HYPER_MASK);
+    mask |= modifiers & (IBUS_CONTROL_MASK | IBUS_SHIFT_MASK);
+    index = ibus_m17n_key_symbol_modifier_index (mask);
+    key = ((guint64) keyval << N_KEY_SYMBOL_MODIFIERS) | index;
 
+    if (key_symbols == NULL)
+        key_symbols = g_hash_table_new_full (g_int64_hash,
+                                             g_int64_equal,
+                                             g_free,
+                                             NULL);
+    else if (g_hash_table_lookup_extended (key_symbols, &key, NULL, &value))
+        return (MSymbol) value;
 
-    if (mask & IBUS_HYPER_MASK) {
-        g_string_prepend (keysym, "H-");
-    }
-    if (mask & IBUS_SUPER_MASK) {
-        g_string_prepend (keysym, "s-");
-    }
-    if (mask & IBUS_MOD5_MASK) {
-        g_string_prepend (keysym, "G-");
-    }
-    if (mask & IBUS_MOD1_MASK) {
-        g_string_prepend (keysym, "A-");
-    }
-    if (mask & IBUS_META_MASK) {
-        g_string_prepend (keysym, "M-");
-    }
-    if (mask & IBUS_CONTROL_MASK) {
-        g_string_prepend (keysym, "C-");
-    }
-    if (mask & IBUS_SHIFT_MASK) {
-        g_string_prepend (keysym, "S-");
-    }
+    name = ibus_keyval_name (keyval);
+    if (name != NULL && *name != '\0')
+        mkeysym = ibus_m17n_key_symbol_new (name, mask);
 
-    mkeysym = msymbol (keysym->str);
-    g_string_free (keysym, TRUE);
+    stored_key = g_new (guint64, 1);
+    *stored_key = key;
+    g_hash_table_insert (key_symbols, stored_key, mkeysym);
 
     return mkeysym;
 }
 
+/* Sends the updates of the key event and releases its temporaries. */
+static void
+ibus_m17n_engine_finish_key (IBusM17NEngine *m17n,
+                             IBusM17NStats  *stats)
+{
+    gint64 start = 0, convert_usec = m17n->convert_usec;
+
+    if (stats)
+        start = g_get_monotonic_time ();
+
+    ibus_m17n_engine_flush (m17n);
+
+    if (stats) {
+        gint64 flush_usec = g_get_monotonic_time () - start;
+
+        ibus_m17n_stats_add (stats, IBUS_M17N_PHASE_CONVERT,
+                             m17n->convert_usec);
+        ibus_m17n_stats_add (stats, IBUS_M17N_PHASE_EMIT,
+                             flush_usec - (m17n->convert_usec - convert_usec));
+        m17n->convert_usec = 0;
+    }
+
+    ibus_m17n_arena_reset (&m17n->arena);
+}
+
 static gboolean
 ibus_m17n_engine_process_key (IBusM17NEngine *m17n,
                               MSymbol         key)
 {
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    IBusM17NStats *stats = klass->stats;
+    gint64 start = 0, now;
     gchar *buf;
-    MText *produced;
     gint retval;
 
+    /* the input method is not opened yet */
+    if (m17n->context == NULL)
+        return FALSE;
+
+    if (stats)
+        start = g_get_monotonic_time ();
+
     retval = minput_filter (m17n->context, key, NULL);
 
+    if (stats) {
+        now = g_get_monotonic_time ();
+        ibus_m17n_stats_add (stats, IBUS_M17N_PHASE_FILTER, now - start);
+        start = now;
+    }
+
     if (retval) {
+        m17n->idle = FALSE;
+        ibus_m17n_engine_finish_key (m17n, stats);
         return TRUE;
     }
 
-    produced = mtext ();
+    retval = minput_lookup (m17n->context, key, NULL, m17n->produced);
 
-    retval = minput_lookup (m17n->context, key, NULL, produced);
+    if (stats)
+        ibus_m17n_stats_add (stats, IBUS_M17N_PHASE_LOOKUP,
+                             g_get_monotonic_time () - start);
+
+    /* m17n-lib returns to the initial state before it gives up a key */
+    m17n->idle = retval != 0;
 
     if (retval) {
         // g_debug ("minput_lookup returns %d", retval);
     }
 
-    buf = ibus_m17n_mtext_to_utf8 (produced);
-    m17n_object_unref (produced);
+    if (mtext_len (m17n->produced) > 0) {
+        buf = ibus_m17n_engine_mtext_to_utf8 (m17n, m17n->produced);
+        mtext_del (m17n->produced, 0, mtext_len (m17n->produced));
 
-    if (buf && strlen (buf)) {
-        ibus_m17n_engine_commit_string (m17n, buf);
+        if (buf && strlen (buf)) {
+            ibus_m17n_engine_commit_string (m17n, buf);
+        }
     }
-    g_free (buf);
+
+    ibus_m17n_engine_finish_key (m17n, stats);
 
     return retval == 0;
 }
 
+/* A key can be passed back to the client without asking m17n-lib if the
+   input method binds it nowhere and nothing is pending in the context. */
 static gboolean
-ibus_m17n_engine_process_key_event (IBusEngine     *engine,
-                                    guint           keyval,
-                                    guint           keycode,
-                                    guint           modifiers)
+ibus_m17n_engine_can_pass_through (IBusM17NEngine *m17n,
+                                   MSymbol         key)
 {
-    IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    const gchar *name;
+    guchar c;
+
+    if (!klass->consumable_keys_known || !m17n->idle)
+        return FALSE;
+
+    name = msymbol_name (key);
+    if (name[0] == '\0' || name[1] != '\0')
+        return FALSE;
+
+    c = name[0];
+    if (c >= 128 || klass->consumable_keys[c >> 5] & (1U << (c & 31)))
+        return FALSE;
+
+    return mtext_len (m17n->context->preedit) == 0 &&
+        !m17n->context->candidate_show;
+}
+
+static void
+ibus_m17n_engine_record (IBusM17NEngine       *m17n,
+                         IBusM17NKeyTraceType  type,
+                         guint                 keyval,
+                         guint                 keycode,
+                         guint                 modifiers)
+{
+    if (m17n->trace_engine && !m17n->trace_nested)
+        ibus_m17n_key_trace_record (m17n->trace_engine, type,
+                                    keyval, keycode, modifiers);
+}
+
+static gboolean
+ibus_m17n_engine_filter_key_event (IBusM17NEngine *m17n,
+                                   guint           keyval,
+                                   guint           keycode,
+                                   guint           modifiers)
+{
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    gint64 start = 0;
+    gboolean retval;
 
     if (modifiers & IBUS_RELEASE_MASK)
         return FALSE;
+
+    if (klass->stats)
+        start = g_get_monotonic_time ();
+
     MSymbol m17n_key = ibus_m17n_key_event_to_symbol (keycode, keyval, modifiers);
 
+    if (klass->stats)
+        ibus_m17n_stats_add (klass->stats, IBUS_M17N_PHASE_KEY_SYMBOL,
+                             g_get_monotonic_time () - start);
+
     if (m17n_key == Mnil)
+        retval = FALSE;
+    else if (ibus_m17n_engine_can_pass_through (m17n, m17n_key))
+        retval = FALSE;
+    else
+        retval = ibus_m17n_engine_process_key (m17n, m17n_key);
+
+    if (klass->stats)
+        ibus_m17n_stats_add (klass->stats, IBUS_M17N_PHASE_TOTAL,
+                             g_get_monotonic_time () - start);
+
+    return retval;
+}
+
+/* Keeps an event until the input method is opened, so that keys, focus
+   changes and resets reach it in the order they were received.  Returns
+   FALSE if the input method is open, or failed to open. */
+static gboolean
+ibus_m17n_engine_queue_event (IBusM17NEngine       *m17n,
+                              IBusM17NKeyTraceType  type,
+                              guint                 keyval,
+                              guint                 keycode,
+                              guint                 modifiers)
+{
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    IBusM17NQueuedEvent *queued;
+
+    if (m17n->context != NULL || klass->open_im_id == 0)
         return FALSE;
 
-    return ibus_m17n_engine_process_key (m17n, m17n_key);
+    queued = g_slice_new (IBusM17NQueuedEvent);
+    queued->type = type;
+    queued->keyval = keyval;
+    queued->keycode = keycode;
+    queued->modifiers = modifiers;
+    g_queue_push_tail (&m17n->queued_events, queued);
+
+    return TRUE;
+}
+
+static gboolean
+ibus_m17n_engine_process_key_event (IBusEngine     *engine,
+                                    guint           keyval,
+                                    guint           keycode,
+                                    guint           modifiers)
+{
+    IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
+
+    ibus_m17n_engine_record (m17n, IBUS_M17N_KEY_TRACE_KEY,
+                             keyval, keycode, modifiers);
+
+    /* releases are queued too, so the client gets them in order */
+    if (ibus_m17n_engine_queue_event (m17n, IBUS_M17N_KEY_TRACE_KEY,
+                                      keyval, keycode, modifiers))
+        return TRUE;
+
+    return ibus_m17n_engine_filter_key_event (m17n, keyval, keycode, modifiers);
+}
+
+static void
+ibus_m17n_engine_reset_ic (IBusM17NEngine *m17n)
+{
+    if (m17n->context)
+        minput_reset_ic (m17n->context);
+    m17n->idle = TRUE;
+    ibus_m17n_engine_flush (m17n);
+    ibus_m17n_arena_reset (&m17n->arena);
+}
+
+/* Gives the events received before the input method was opened to the
+   input method, and the keys it does not handle back to the client.  A
+   focus out is never queued, see ibus_m17n_engine_forward_queued_keys. */
+static void
+ibus_m17n_engine_replay_queued_events (IBusM17NEngine *m17n)
+{
+    IBusM17NQueuedEvent *queued;
+
+    while ((queued = g_queue_pop_head (&m17n->queued_events)) != NULL) {
+        switch (queued->type) {
+        case IBUS_M17N_KEY_TRACE_KEY:
+            if (!ibus_m17n_engine_filter_key_event (m17n,
+                                                    queued->keyval,
+                                                    queued->keycode,
+                                                    queued->modifiers))
+                ibus_engine_forward_key_event ((IBusEngine *) m17n,
+                                               queued->keyval,
+                                               queued->keycode,
+                                               queued->modifiers);
+            break;
+        case IBUS_M17N_KEY_TRACE_FOCUS_IN:
+            ibus_m17n_engine_process_key (m17n, Minput_focus_in);
+            break;
+        case IBUS_M17N_KEY_TRACE_RESET:
+            ibus_m17n_engine_reset_ic (m17n);
+            break;
+        default:
+            g_assert_not_reached ();
+        }
+        g_slice_free (IBusM17NQueuedEvent, queued);
+    }
+}
+
+/* Gives the keys received before the input method was opened back to the
+   client unprocessed, and drops the other events.  Used at focus out, as
+   the text they would produce could not be committed before the input
+   method is opened, and would then go to whatever has the focus. */
+static void
+ibus_m17n_engine_forward_queued_keys (IBusM17NEngine *m17n)
+{
+    IBusM17NQueuedEvent *queued;
+
+    while ((queued = g_queue_pop_head (&m17n->queued_events)) != NULL) {
+        if (queued->type == IBUS_M17N_KEY_TRACE_KEY)
+            ibus_engine_forward_key_event ((IBusEngine *) m17n,
+                                           queued->keyval,
+                                           queued->keycode,
+                                           queued->modifiers);
+        g_slice_free (IBusM17NQueuedEvent, queued);
+    }
+}
+
+static gboolean
+ibus_m17n_engine_class_open_im_cb (IBusM17NEngineClass *klass)
+{
+    GSList *engines, *p;
+
+    klass->open_im_id = 0;
+    if (klass->im == NULL)
+        ibus_m17n_engine_class_open_im (klass);
+
+    engines = g_slist_reverse (klass->waiting_engines);
+    klass->waiting_engines = NULL;
+
+    for (p = engines; p != NULL; p = p->next) {
+        IBusM17NEngine *m17n = (IBusM17NEngine *) p->data;
+
+        if (klass->im)
+            m17n->context = minput_create_ic (klass->im, m17n);
+        ibus_m17n_engine_replay_queued_events (m17n);
+    }
+    g_slist_free (engines);
+
+    return FALSE;
 }
 
 static void
@@ -744,8 +2156,17 @@ ibus_m17n_engine_focus_in (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    ibus_m17n_engine_record (m17n, IBUS_M17N_KEY_TRACE_FOCUS_IN, 0, 0, 0);
+
+    m17n->focused = TRUE;
+
+    /* the client may have dropped our preedit while unfocused */
+    m17n->preedit.valid = FALSE;
+    m17n->lookup.valid = FALSE;
+
     ibus_engine_register_properties (engine, m17n->prop_list);
-    ibus_m17n_engine_process_key (m17n, Minput_focus_in);
+    if (!ibus_m17n_engine_queue_event (m17n, IBUS_M17N_KEY_TRACE_FOCUS_IN, 0, 0, 0))
+        ibus_m17n_engine_process_key (m17n, Minput_focus_in);
 
     parent_class->focus_in (engine);
 }
@@ -755,7 +2176,16 @@ ibus_m17n_engine_focus_out (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
-    ibus_m17n_engine_process_key (m17n, Minput_focus_out);
+    ibus_m17n_engine_record (m17n, IBUS_M17N_KEY_TRACE_FOCUS_OUT, 0, 0, 0);
+
+    m17n->focused = FALSE;
+
+    m17n->preedit.valid = FALSE;
+    m17n->lookup.valid = FALSE;
+    if (ibus_m17n_engine_queue_event (m17n, IBUS_M17N_KEY_TRACE_FOCUS_OUT, 0, 0, 0))
+        ibus_m17n_engine_forward_queued_keys (m17n);
+    else
+        ibus_m17n_engine_process_key (m17n, Minput_focus_out);
 
     parent_class->focus_out (engine);
 }
@@ -765,9 +2195,14 @@ ibus_m17n_engine_reset (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    ibus_m17n_engine_record (m17n, IBUS_M17N_KEY_TRACE_RESET, 0, 0, 0);
+
     parent_class->reset (engine);
 
-    minput_reset_ic (m17n->context);
+    m17n->preedit.valid = FALSE;
+    m17n->lookup.valid = FALSE;
+    if (!ibus_m17n_engine_queue_event (m17n, IBUS_M17N_KEY_TRACE_RESET, 0, 0, 0))
+        ibus_m17n_engine_reset_ic (m17n);
 }
 
 static void
@@ -775,6 +2210,10 @@ ibus_m17n_engine_enable (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    ibus_m17n_engine_record (m17n, IBUS_M17N_KEY_TRACE_ENABLE, 0, 0, 0);
+
+    m17n->preedit.valid = FALSE;
+    m17n->lookup.valid = FALSE;
     parent_class->enable (engine);
 }
 
@@ -783,7 +2222,12 @@ ibus_m17n_engine_disable (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    ibus_m17n_engine_record (m17n, IBUS_M17N_KEY_TRACE_DISABLE, 0, 0, 0);
+
+    /* the focus out is replayed as part of the disable event */
+    m17n->trace_nested = TRUE;
     ibus_m17n_engine_focus_out (engine);
+    m17n->trace_nested = FALSE;
     parent_class->disable (engine);
 }
 
@@ -792,6 +2236,7 @@ ibus_m17n_engine_page_up (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    ibus_m17n_engine_record (m17n, IBUS_M17N_KEY_TRACE_PAGE_UP, 0, 0, 0);
     ibus_m17n_engine_process_key (m17n, msymbol ("Up"));
     parent_class->page_up (engine);
 }
@@ -802,6 +2247,7 @@ ibus_m17n_engine_page_down (IBusEngine *engine)
 
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    ibus_m17n_engine_record (m17n, IBUS_M17N_KEY_TRACE_PAGE_DOWN, 0, 0, 0);
     ibus_m17n_engine_process_key (m17n, msymbol ("Down"));
     parent_class->page_down (engine);
 }
@@ -812,6 +2258,7 @@ ibus_m17n_engine_cursor_up (IBusEngine *engine)
 
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    ibus_m17n_engine_record (m17n, IBUS_M17N_KEY_TRACE_CURSOR_UP, 0, 0, 0);
     ibus_m17n_engine_process_key (m17n, msymbol ("Left"));
     parent_class->cursor_up (engine);
 }
@@ -822,6 +2269,7 @@ ibus_m17n_engine_cursor_down (IBusEngine *engine)
 
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    ibus_m17n_engine_record (m17n, IBUS_M17N_KEY_TRACE_CURSOR_DOWN, 0, 0, 0);
     ibus_m17n_engine_process_key (m17n, msymbol ("Right"));
     parent_class->cursor_down (engine);
 }
@@ -850,19 +2298,174 @@ ibus_m17n_engine_property_activate (IBusEngine  *engine,
     parent_class->property_activate (engine, prop_name, prop_state);
 }
 
+static guint
+ibus_m17n_mtext_hash (MText *mt,
+                      guint  hash)
+{
+    enum MTextFormat format;
+    gint nunits, nbytes, i;
+    const guchar *data;
+
+    data = mtext_data (mt, &format, &nunits, NULL, NULL);
+    if (format == MTEXT_FORMAT_US_ASCII || format == MTEXT_FORMAT_UTF_8)
+        nbytes = nunits;
+    else if (format == MTEXT_FORMAT_UTF_16LE || format == MTEXT_FORMAT_UTF_16BE)
+        nbytes = nunits * 2;
+    else
+        nbytes = nunits * 4;
+
+    hash = hash * 33 + format;
+    for (i = 0; i < nbytes; i++)
+        hash = hash * 33 + data[i];
+    return hash;
+}
+
+static guint
+ibus_m17n_candidate_group_hash (MPlist *group)
+{
+    MPlist *p;
+    guint hash = 5381;
+
+    if (mplist_key (group) == Mtext)
+        return ibus_m17n_mtext_hash ((MText *) mplist_value (group), hash);
+
+    for (p = mplist_value (group); mplist_key (p) != Mnil; p = mplist_next (p))
+        hash = ibus_m17n_mtext_hash ((MText *) mplist_value (p), hash * 33);
+    return hash;
+}
+
+static GPtrArray *
+ibus_m17n_engine_convert_candidates (IBusM17NEngine *m17n,
+                                     MPlist         *group)
+{
+    GPtrArray *candidates;
+    IBusText *text;
+
+    candidates = g_ptr_array_new ();
+
+    if (mplist_key (group) == Mtext) {
+        MText *mt;
+        gint nchars, i;
+
+        mt = (MText *) mplist_value (group);
+        nchars = mtext_len (mt);
+
+        for (i = 0; i < nchars; i++) {
+            text = ibus_text_new_from_unichar (mtext_ref_char (mt, i));
+            g_ptr_array_add (candidates, g_object_ref_sink (text));
+        }
+    }
+    else {
+        MPlist *p;
+
+        for (p = (MPlist *) mplist_value (group); mplist_key (p) != Mnil; p = mplist_next (p)) {
+            MText *mtext;
+            gchar *buf;
+
+            mtext = (MText *) mplist_value (p);
+            buf = ibus_m17n_engine_mtext_to_utf8 (m17n, mtext);
+            if (buf) {
+                text = ibus_text_new_from_string (buf);
+                g_ptr_array_add (candidates, g_object_ref_sink (text));
+            }
+        }
+    }
+
+    return candidates;
+}
+
+/* Returns the converted candidates of group from the cache of the class,
+   converting and caching them first if needed.  Groups usually come
+   straight from the maps of the input method, so the same objects are
+   seen again whenever the same candidates are offered; the fingerprint
+   catches a group whose contents changed since it was converted. */
+static GPtrArray *
+ibus_m17n_engine_get_candidates (IBusM17NEngine *m17n,
+                                 MPlist         *group)
+{
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    IBusM17NCandidatePage *page;
+    gpointer value = mplist_value (group);
+    guint hash = ibus_m17n_candidate_group_hash (group);
+
+    page = g_hash_table_lookup (klass->candidate_pages, value);
+    if (page != NULL) {
+        g_queue_unlink (&klass->candidate_page_lru, page->link);
+        if (page->hash == hash) {
+            g_queue_push_head_link (&klass->candidate_page_lru, page->link);
+            return page->candidates;
+        }
+        g_list_free (page->link);
+        g_hash_table_remove (klass->candidate_pages, value);
+        ibus_m17n_candidate_page_free (page);
+    }
+
+    if (g_queue_get_length (&klass->candidate_page_lru) >= MAX_CANDIDATE_PAGES) {
+        page = g_queue_pop_tail (&klass->candidate_page_lru);
+        g_hash_table_remove (klass->candidate_pages, page->group);
+        ibus_m17n_candidate_page_free (page);
+    }
+
+    page = g_slice_new (IBusM17NCandidatePage);
+    page->group = value;
+    m17n_object_ref (value);
+    page->hash = hash;
+    page->candidates = ibus_m17n_engine_convert_candidates (m17n, group);
+    g_queue_push_head (&klass->candidate_page_lru, page);
+    page->link = g_queue_peek_head_link (&klass->candidate_page_lru);
+    g_hash_table_insert (klass->candidate_pages, value, page);
+
+    return page->candidates;
+}
+
 static void
-ibus_m17n_engine_update_lookup_table (IBusM17NEngine *m17n)
+ibus_m17n_engine_fill_lookup_table (IBusM17NEngine *m17n,
+                                    MPlist         *group)
 {
+    GPtrArray *candidates;
+    guint i;
+
     ibus_lookup_table_clear (m17n->table);
 
-    if (m17n->context->candidate_list && m17n->context->candidate_show) {
+    candidates = ibus_m17n_engine_get_candidates (m17n, group);
+    ibus_lookup_table_set_page_size (m17n->table, candidates->len);
+
+    for (i = 0; i < candidates->len; i++) {
+        ibus_lookup_table_append_candidate (m17n->table,
+                                            g_ptr_array_index (candidates, i));
+    }
+}
+
+static void
+ibus_m17n_engine_update_lookup_table (IBusM17NEngine *m17n)
+{
+    IBusM17NLookupState *state = &m17n->lookup;
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    MPlist *candidate_list = m17n->context->candidate_list;
+    gint index = m17n->context->candidate_index;
+
+    if (candidate_list && m17n->context->candidate_show) {
         IBusText *text;
         MPlist *group;
-        group = m17n->context->candidate_list;
         gint i = 0;
         gint page = 1;
-        IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
 
+        /* Moving within the page shown only changes the cursor, so the
+           candidates and the page number need not be built again. */
+        if (state->valid &&
+            state->visible &&
+            state->candidate_list == candidate_list &&
+            state->orientation == klass->lookup_table_orientation &&
+            index >= state->start &&
+            index < state->start + state->length) {
+            if (ibus_lookup_table_get_cursor_pos (m17n->table) != index - state->start) {
+                ibus_lookup_table_set_cursor_pos (m17n->table, index - state->start);
+                ibus_engine_update_lookup_table ((IBusEngine *)m17n, m17n->table, TRUE);
+            }
+            return;
+        }
+
+        group = candidate_list;
         while (1) {
             gint len;
             if (mplist_key (group) == Mtext)
@@ -870,58 +2473,42 @@ ibus_m17n_engine_update_lookup_table (IBusM17NEngine *m17n)
             else
                 len = mplist_length ((MPlist *) mplist_value (group));
 
-            if (i + len > m17n->context->candidate_index)
+            if (i + len > index) {
+                state->length = len;
                 break;
+            }
 
             i += len;
             group = mplist_next (group);
             page ++;
         }
 
-        if (mplist_key (group) == Mtext) {
-            MText *mt;
-            gunichar *buf;
-            glong nchars, i;
-
-            mt = (MText *) mplist_value (group);
-            ibus_lookup_table_set_page_size (m17n->table, mtext_len (mt));
-
-            buf = ibus_m17n_mtext_to_ucs4 (mt, &nchars);
-            for (i = 0; i < nchars; i++) {
-                ibus_lookup_table_append_candidate (m17n->table, ibus_text_new_from_unichar (buf[i]));
-            }
-            g_free (buf);
-        }
-        else {
-            MPlist *p;
-
-            p = (MPlist *) mplist_value (group);
-            ibus_lookup_table_set_page_size (m17n->table, mplist_length (p));
-
-            for (; mplist_key (p) != Mnil; p = mplist_next (p)) {
-                MText *mtext;
-                gchar *buf;
+        ibus_m17n_engine_fill_lookup_table (m17n, group);
 
-                mtext = (MText *) mplist_value (p);
-                buf = ibus_m17n_mtext_to_utf8 (mtext);
-                if (buf) {
-                    ibus_lookup_table_append_candidate (m17n->table, ibus_text_new_from_string (buf));
-                    g_free (buf);
-                }
-            }
-        }
-
-        ibus_lookup_table_set_cursor_pos (m17n->table, m17n->context->candidate_index - i);
+        ibus_lookup_table_set_cursor_pos (m17n->table, index - i);
         ibus_lookup_table_set_orientation (m17n->table, klass->lookup_table_orientation);
 
-        text = ibus_text_new_from_printf ("( %d / %d )", page, mplist_length (m17n->context->candidate_list));
+        text = ibus_text_new_from_printf ("( %d / %d )", page, mplist_length (candidate_list));
 
         ibus_engine_update_lookup_table ((IBusEngine *)m17n, m17n->table, TRUE);
         ibus_engine_update_auxiliary_text ((IBusEngine *)m17n, text, TRUE);
+
+        if (state->candidate_list != candidate_list) {
+            m17n_object_ref (candidate_list);
+            if (state->candidate_list)
+                m17n_object_unref (state->candidate_list);
+            state->candidate_list = candidate_list;
+        }
+        state->start = i;
+        state->orientation = klass->lookup_table_orientation;
+        state->visible = TRUE;
+        state->valid = TRUE;
     }
-    else {
+    else if (state->visible || !state->valid) {
         ibus_engine_hide_lookup_table ((IBusEngine *)m17n);
         ibus_engine_hide_auxiliary_text ((IBusEngine *)m17n);
+        state->visible = FALSE;
+        state->valid = TRUE;
     }
 }
 
@@ -941,47 +2528,30 @@ ibus_m17n_engine_callback (MInputContext *context,
     }
 
     if (command == Minput_preedit_start) {
-        ibus_engine_hide_preedit_text ((IBusEngine *)m17n);
+        m17n->pending.preedit = TRUE;
     }
     else if (command == Minput_preedit_draw) {
-        ibus_m17n_engine_update_preedit (m17n);
+        m17n->pending.preedit = TRUE;
     }
     else if (command == Minput_preedit_done) {
-        ibus_engine_hide_preedit_text ((IBusEngine *)m17n);
+        m17n->pending.preedit = TRUE;
     }
     else if (command == Minput_status_start) {
-        ibus_engine_hide_preedit_text ((IBusEngine *)m17n);
+        m17n->pending.preedit = TRUE;
     }
     else if (command == Minput_status_draw) {
-        gchar *status;
-        status = ibus_m17n_mtext_to_utf8 (m17n->context->status);
-
-        if (status && strlen (status)) {
-            IBusText *text;
-            text = ibus_text_new_from_string (status);
-            ibus_property_set_label (m17n->status_prop, text);
-            ibus_property_set_visible (m17n->status_prop, TRUE);
-        }
-        else {
-            ibus_property_set_label (m17n->status_prop, NULL);
-            ibus_property_set_visible (m17n->status_prop, FALSE);
-        }
-
-        ibus_engine_update_property ((IBusEngine *)m17n, m17n->status_prop);
-        g_free (status);
+        m17n->pending.status = TRUE;
     }
     else if (command == Minput_status_done) {
     }
     else if (command == Minput_candidates_start) {
-        ibus_engine_hide_lookup_table ((IBusEngine *) m17n);
-        ibus_engine_hide_auxiliary_text ((IBusEngine *) m17n);
+        m17n->pending.lookup_table = TRUE;
     }
     else if (command == Minput_candidates_draw) {
-        ibus_m17n_engine_update_lookup_table (m17n);
+        m17n->pending.lookup_table = TRUE;
     }
     else if (command == Minput_candidates_done) {
-        ibus_engine_hide_lookup_table ((IBusEngine *) m17n);
-        ibus_engine_hide_auxiliary_text ((IBusEngine *) m17n);
+        m17n->pending.lookup_table = TRUE;
     }
     else if (command == Minput_set_spot) {
     }
@@ -1043,3 +2613,241 @@ ibus_m17n_engine_callback (MInputContext *context,
                                                  0, len);
     }
 }
+
+static guint
+ibus_m17n_plist_hash (MPlist *plist,
+                      guint   hash)
+{
+    MPlist *p;
+
+    for (p = plist; p && mplist_key (p) != Mnil; p = mplist_next (p)) {
+        MSymbol key = mplist_key (p);
+
+        hash = g_str_hash (msymbol_name (key)) + hash * 33;
+        if (key == Msymbol)
+            hash = g_str_hash (msymbol_name ((MSymbol) mplist_value (p))) + hash * 33;
+        else if (key == Mtext)
+            hash = ibus_m17n_mtext_hash ((MText *) mplist_value (p), hash);
+        else if (key == Minteger)
+            hash = (guint) (long) mplist_value (p) + hash * 33;
+        else if (key == Mplist)
+            hash = ibus_m17n_plist_hash ((MPlist *) mplist_value (p), hash);
+    }
+    return hash;
+}
+
+/* Hashes the variables and commands of the input method of klass, as
+   customized by config.mic. */
+static guint
+ibus_m17n_engine_class_config_hash (IBusM17NEngineClass *klass)
+{
+    guint hash = 5381;
+
+    hash = ibus_m17n_plist_hash (minput_get_variable (klass->im_lang,
+                                                      klass->im_name,
+                                                      Mnil), hash);
+    hash = ibus_m17n_plist_hash (minput_get_command (klass->im_lang,
+                                                     klass->im_name,
+                                                     Mnil), hash);
+    return hash;
+}
+
+/* Reopens the input method of klass, so that it is read again from its
+   .mim file and config.mic.  The engines of the class stay alive and
+   get new input contexts. */
+static void
+ibus_m17n_engine_class_reopen_im (IBusM17NEngineClass *klass)
+{
+    GSList *engines = NULL, *p;
+
+    /* not opened yet, it will be read from the new files */
+    if (klass->im == NULL)
+        return;
+
+    /* the engines still waiting for the input method get their contexts
+       when their queued events are replayed */
+    for (p = klass->engines; p != NULL; p = p->next) {
+        IBusM17NEngine *m17n = (IBusM17NEngine *) p->data;
+
+        if (m17n->context == NULL)
+            continue;
+        engines = g_slist_prepend (engines, m17n);
+
+        /* hide what the old context shows */
+        minput_reset_ic (m17n->context);
+        ibus_m17n_engine_flush (m17n);
+        ibus_m17n_arena_reset (&m17n->arena);
+
+        minput_destroy_ic (m17n->context);
+        m17n->context = NULL;
+    }
+
+    ibus_m17n_engine_class_clear_candidate_pages (klass);
+    minput_close_im (klass->im);
+    klass->im = NULL;
+    klass->consumable_keys_known = FALSE;
+
+    /* the engines pass all keys through if it can not be opened */
+    if (!ibus_m17n_engine_class_open_im (klass)) {
+        g_slist_free (engines);
+        return;
+    }
+
+    for (p = engines; p != NULL; p = p->next) {
+        IBusM17NEngine *m17n = (IBusM17NEngine *) p->data;
+
+        m17n->context = minput_create_ic (klass->im, m17n);
+        m17n->idle = TRUE;
+        m17n->preedit.valid = FALSE;
+        m17n->lookup.valid = FALSE;
+        if (m17n->focused)
+            ibus_m17n_engine_process_key (m17n, Minput_focus_in);
+    }
+    g_slist_free (engines);
+}
+
+/* files changed since the last reload, and the timeout reloading them */
+static GHashTable *changed_files = NULL;
+static guint reload_id = 0;
+
+static gboolean
+ibus_m17n_engine_reload_cb (gpointer user_data)
+{
+    GHashTable *reopen;
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean config_changed = FALSE;
+    gboolean mic_changed = FALSE;
+
+    reload_id = 0;
+    reopen = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    g_hash_table_iter_init (&iter, changed_files);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        const gchar *path = key;
+        gchar *lang, *name;
+
+        if (strcmp (path, DEFAULT_XML) == 0) {
+            config_changed = TRUE;
+        }
+        else if (g_str_has_suffix (path, ".mim")) {
+            /* a removed .mim file can not be read; its input method
+               stays loaded as long as its engines */
+            if (ibus_m17n_mim_file_get_name (path, &lang, &name)) {
+                gchar *engine_name = g_strdup_printf ("m17n:%s:%s", lang, name);
+                GType type = 0;
+                gpointer klass = NULL;
+
+                if (engine_types)
+                    type = GPOINTER_TO_SIZE (g_hash_table_lookup (engine_types,
+                                                                  engine_name));
+                if (type)
+                    klass = g_type_class_peek (type);
+                if (klass)
+                    g_hash_table_insert (reopen, klass, klass);
+                g_free (engine_name);
+                g_free (lang);
+                g_free (name);
+            }
+        }
+        else if (g_str_has_suffix (path, "config.mic")) {
+            mic_changed = TRUE;
+        }
+    }
+    g_hash_table_remove_all (changed_files);
+
+    if (config_changed)
+        ibus_m17n_reload_config ();
+
+    if (engine_classes && (config_changed || mic_changed)) {
+        g_hash_table_iter_init (&iter, engine_classes);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            IBusM17NEngineClass *klass = (IBusM17NEngineClass *) value;
+
+            if (config_changed) {
+                ibus_m17n_engine_class_set_defaults (klass);
+                ibus_m17n_engine_class_load_config (klass);
+            }
+            if (mic_changed && klass->im &&
+                klass->im_config_hash != ibus_m17n_engine_class_config_hash (klass))
+                g_hash_table_insert (reopen, klass, klass);
+        }
+    }
+
+    g_hash_table_iter_init (&iter, reopen);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        ibus_m17n_engine_class_reopen_im ((IBusM17NEngineClass *) key);
+    g_hash_table_destroy (reopen);
+
+    return FALSE;
+}
+
+static void
+ibus_m17n_engine_file_changed_cb (GFileMonitor      *monitor,
+                                  GFile             *file,
+                                  GFile             *other_file,
+                                  GFileMonitorEvent  event_type,
+                                  gpointer           user_data)
+{
+    gchar *path;
+
+    if (event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+        event_type != G_FILE_MONITOR_EVENT_CREATED &&
+        event_type != G_FILE_MONITOR_EVENT_DELETED)
+        return;
+
+    path = g_file_get_path (file);
+    if (path == NULL)
+        return;
+    g_hash_table_replace (changed_files, path, NULL);
+
+    /* editors write files in several steps, reload once they are done */
+    if (reload_id == 0)
+        reload_id = g_timeout_add (RELOAD_DELAY, ibus_m17n_engine_reload_cb, NULL);
+}
+
+static void
+ibus_m17n_engine_monitor (GFile   *file,
+                          gboolean directory)
+{
+    GFileMonitor *monitor;
+    GError *error = NULL;
+
+    if (directory)
+        monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE, NULL, &error);
+    else
+        monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, &error);
+
+    if (monitor == NULL) {
+        g_debug ("Can not monitor changes: %s", error->message);
+        g_error_free (error);
+        return;
+    }
+
+    /* the monitors live as long as the component */
+    g_signal_connect (monitor, "changed",
+                      G_CALLBACK (ibus_m17n_engine_file_changed_cb), NULL);
+}
+
+void
+ibus_m17n_engine_watch_changes (void)
+{
+    gchar **dirs, **p;
+    GFile *file;
+
+    if (changed_files)
+        return;
+    changed_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    file = g_file_new_for_path (DEFAULT_XML);
+    ibus_m17n_engine_monitor (file, FALSE);
+    g_object_unref (file);
+
+    dirs = ibus_m17n_get_database_dirs ();
+    for (p = dirs; *p != NULL; p++) {
+        file = g_file_new_for_path (*p);
+        ibus_m17n_engine_monitor (file, TRUE);
+        g_object_unref (file);
+    }
+    g_strfreev (dirs);
+}
@@ -5,5 +5,9 @@
 #include <ibus.h>
 
 GType   ibus_m17n_engine_get_type_for_name (const gchar *name);
+void    ibus_m17n_engine_preload_recent    (void);
+void    ibus_m17n_engine_save_recent       (void);
+/* reloads default.xml and the input methods when their files change */
+void    ibus_m17n_engine_watch_changes     (void);
 
 #endif
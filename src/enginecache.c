@@ -0,0 +1,537 @@
+/* vim:set et sts=4: */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "m17nutil.h"
+#include "enginecache.h"
+#include "trace.h"
+
+/*
+ * The cache is a text file written as the engines are listed, so that
+ * their descriptions are never all held in memory:
+ *
+ *   ibus-m17n-engine-cache VERSION
+ *   package PACKAGE_VERSION
+ *   locale LOCALE
+ *   files COUNT
+ *   STAMP LANG PATH            COUNT lines, LANG is "-" for non-.mim files
+ *   engine LANG LINES          followed by LINES lines of <engine> XML
+ *   ...
+ */
+#define ENGINE_CACHE_MAGIC "ibus-m17n-engine-cache"
+
+/* bump when the layout of the cache file changes */
+#define ENGINE_CACHE_VERSION 2
+
+struct _IBusM17NCacheEntry {
+    gchar *stamp;
+    /* language of a .mim file, NULL for other files */
+    gchar *lang;
+};
+
+typedef struct _IBusM17NCacheEntry IBusM17NCacheEntry;
+
+static IBusM17NCacheEntry *
+ibus_m17n_cache_entry_new (const gchar *stamp,
+                           const gchar *lang)
+{
+    IBusM17NCacheEntry *entry = g_slice_new (IBusM17NCacheEntry);
+
+    entry->stamp = g_strdup (stamp);
+    entry->lang = g_strdup (lang);
+    return entry;
+}
+
+static void
+ibus_m17n_cache_entry_free (IBusM17NCacheEntry *entry)
+{
+    g_free (entry->stamp);
+    g_free (entry->lang);
+    g_slice_free (IBusM17NCacheEntry, entry);
+}
+
+static gchar *
+ibus_m17n_engine_cache_filename (void)
+{
+    return g_build_filename (g_get_user_cache_dir (),
+                             "ibus-m17n",
+                             ibus_m17n_get_list_brief () ?
+                                "engines-brief.cache" : "engines.cache",
+                             NULL);
+}
+
+/* Descriptions are translated by m17n-lib, so they are only valid for
+   the message locale they were generated in. */
+static gchar *
+ibus_m17n_engine_cache_locale (void)
+{
+    const gchar *messages = setlocale (LC_MESSAGES, NULL);
+    const gchar *language = g_getenv ("LANGUAGE");
+
+    return g_strdup_printf ("%s %s",
+                            messages ? messages : "",
+                            language ? language : "");
+}
+
+static gchar *
+ibus_m17n_engine_cache_stamp (const gchar *path)
+{
+    struct stat st;
+
+    if (g_stat (path, &st) != 0)
+        return NULL;
+
+    return g_strdup_printf ("%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT
+                            ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT,
+                            (gint64) st.st_mtime,
+                            (gint64) st.st_ctime,
+                            (guint64) st.st_ino,
+                            (gint64) st.st_size);
+}
+
+static void
+ibus_m17n_engine_cache_stamp_dir (GHashTable  *stamps,
+                                  const gchar *dirname)
+{
+    GDir *dir;
+    const gchar *name;
+
+    dir = g_dir_open (dirname, 0, NULL);
+    if (dir == NULL)
+        return;
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        gchar *path;
+        gchar *stamp;
+
+        if (name[0] == '.')
+            continue;
+
+        path = g_build_filename (dirname, name, NULL);
+        stamp = ibus_m17n_engine_cache_stamp (path);
+        if (stamp)
+            g_hash_table_insert (stamps, path, stamp);
+        else
+            g_free (path);
+    }
+    g_dir_close (dir);
+}
+
+/* Stamps default.xml and every entry of the m17n database directories.
+   The directories themselves are not stamped, so adding an .mim file
+   only invalidates its own language. */
+static GHashTable *
+ibus_m17n_engine_cache_scan_stamps (void)
+{
+    GHashTable *stamps;
+    gchar **dirs, **p;
+    gchar *stamp;
+
+    stamps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    stamp = ibus_m17n_engine_cache_stamp (DEFAULT_XML);
+    if (stamp)
+        g_hash_table_insert (stamps, g_strdup (DEFAULT_XML), stamp);
+
+    dirs = ibus_m17n_get_database_dirs ();
+    for (p = dirs; *p != NULL; p++)
+        ibus_m17n_engine_cache_stamp_dir (stamps, *p);
+    g_strfreev (dirs);
+
+    return stamps;
+}
+
+/* Reads a line without its newline.  Returns FALSE at the end of the
+   file, or if the last line was cut short. */
+static gboolean
+ibus_m17n_engine_cache_read_line (FILE    *fp,
+                                  GString *line)
+{
+    gchar buf[512];
+
+    g_string_truncate (line, 0);
+    while (fgets (buf, sizeof (buf), fp) != NULL) {
+        g_string_append (line, buf);
+        if (line->str[line->len - 1] == '\n') {
+            g_string_truncate (line, line->len - 1);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Reads a "KEY VALUE" line and returns its value, or NULL. */
+static const gchar *
+ibus_m17n_engine_cache_read_field (FILE        *fp,
+                                   GString     *line,
+                                   const gchar *key)
+{
+    gsize length = strlen (key);
+
+    if (!ibus_m17n_engine_cache_read_line (fp, line) ||
+        strncmp (line->str, key, length) != 0 ||
+        line->str[length] != ' ')
+        return NULL;
+
+    return line->str + length + 1;
+}
+
+/* Loads the file entries of a cache generated by this build in the
+   current locale, or returns NULL.  fp is left at the first engine. */
+static GHashTable *
+ibus_m17n_engine_cache_load (FILE *fp)
+{
+    GHashTable *entries;
+    GString *line;
+    const gchar *value;
+    gchar *locale;
+    gboolean valid;
+    guint64 n_files, i;
+
+    line = g_string_new (NULL);
+
+    value = ibus_m17n_engine_cache_read_field (fp, line, ENGINE_CACHE_MAGIC);
+    valid = value && g_ascii_strtoull (value, NULL, 10) == ENGINE_CACHE_VERSION;
+
+    if (valid) {
+        value = ibus_m17n_engine_cache_read_field (fp, line, "package");
+        valid = g_strcmp0 (value, VERSION) == 0;
+    }
+
+    if (valid) {
+        value = ibus_m17n_engine_cache_read_field (fp, line, "locale");
+        locale = ibus_m17n_engine_cache_locale ();
+        valid = g_strcmp0 (value, locale) == 0;
+        g_free (locale);
+    }
+
+    if (valid) {
+        value = ibus_m17n_engine_cache_read_field (fp, line, "files");
+        valid = value != NULL;
+    }
+
+    if (!valid) {
+        g_string_free (line, TRUE);
+        return NULL;
+    }
+
+    n_files = g_ascii_strtoull (value, NULL, 10);
+    entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                     (GDestroyNotify) ibus_m17n_cache_entry_free);
+
+    for (i = 0; i < n_files; i++) {
+        gchar **fields;
+
+        if (!ibus_m17n_engine_cache_read_line (fp, line)) {
+            g_hash_table_destroy (entries);
+            entries = NULL;
+            break;
+        }
+
+        fields = g_strsplit (line->str, " ", 3);
+        if (g_strv_length (fields) == 3) {
+            const gchar *lang = strcmp (fields[1], "-") != 0 ? fields[1] : NULL;
+
+            g_hash_table_insert (entries,
+                                 g_strdup (fields[2]),
+                                 ibus_m17n_cache_entry_new (fields[0], lang));
+        }
+        g_strfreev (fields);
+    }
+    g_string_free (line, TRUE);
+
+    return entries;
+}
+
+/* Opens a temporary file next to filename for the new cache, and writes
+   its header. */
+static FILE *
+ibus_m17n_engine_cache_create (const gchar  *filename,
+                               GPtrArray    *files,
+                               gchar       **tmpname)
+{
+    gchar *dirname;
+    gchar *locale;
+    FILE *fp = NULL;
+    gint fd;
+    guint i;
+
+    dirname = g_path_get_dirname (filename);
+    g_mkdir_with_parents (dirname, 0700);
+    g_free (dirname);
+
+    *tmpname = g_strdup_printf ("%s.XXXXXX", filename);
+    fd = g_mkstemp (*tmpname);
+    if (fd >= 0)
+        fp = fdopen (fd, "w");
+    if (fp == NULL) {
+        g_debug ("can not write %s: %s", filename, g_strerror (errno));
+        if (fd >= 0) {
+            close (fd);
+            g_unlink (*tmpname);
+        }
+        g_free (*tmpname);
+        *tmpname = NULL;
+        return NULL;
+    }
+
+    locale = ibus_m17n_engine_cache_locale ();
+    fprintf (fp, "%s %d\n", ENGINE_CACHE_MAGIC, ENGINE_CACHE_VERSION);
+    fprintf (fp, "package %s\n", VERSION);
+    fprintf (fp, "locale %s\n", locale);
+    fprintf (fp, "files %u\n", files->len);
+    for (i = 0; i < files->len; i++)
+        fprintf (fp, "%s\n", (const gchar *) files->pdata[i]);
+    g_free (locale);
+
+    return fp;
+}
+
+/* Replaces the cache with the new one, unless writing it failed. */
+static void
+ibus_m17n_engine_cache_commit (FILE        *fp,
+                               const gchar *tmpname,
+                               const gchar *filename)
+{
+    gboolean failed = ferror (fp);
+
+    if (fclose (fp) != 0)
+        failed = TRUE;
+
+    if (failed || g_rename (tmpname, filename) != 0) {
+        g_debug ("can not write %s: %s", filename, g_strerror (errno));
+        g_unlink (tmpname);
+    }
+}
+
+/* Writes the engines to the output, and to the new cache if it is being
+   written, as they are listed. */
+struct _IBusM17NCacheWriter {
+    FILE *fp;
+    FILE *cache_fp;
+    GString *buf;
+};
+
+typedef struct _IBusM17NCacheWriter IBusM17NCacheWriter;
+
+static void
+ibus_m17n_cache_writer_add (IBusEngineDesc      *engine,
+                            IBusM17NCacheWriter *writer)
+{
+#if IBUS_CHECK_VERSION(1,3,99)
+    const gchar *lang = ibus_engine_desc_get_language (engine);
+#else
+    const gchar *lang = engine->language;
+#endif  /* !IBUS_CHECK_VERSION(1,3,99) */
+    const gchar *p;
+    guint n_lines = 0;
+
+    g_string_truncate (writer->buf, 0);
+    ibus_engine_desc_output (engine, writer->buf, 1);
+    if (writer->buf->len == 0 || writer->buf->str[writer->buf->len - 1] != '\n')
+        g_string_append_c (writer->buf, '\n');
+    fputs (writer->buf->str, writer->fp);
+
+    if (writer->cache_fp == NULL)
+        return;
+
+    for (p = writer->buf->str; *p != '\0'; p++)
+        if (*p == '\n')
+            n_lines++;
+    fprintf (writer->cache_fp, "engine %s %u\n", lang, n_lines);
+    fputs (writer->buf->str, writer->cache_fp);
+}
+
+/* Lists the engines of language, or of all languages if it is Mnil. */
+static void
+ibus_m17n_engine_cache_list (IBusM17NCacheWriter *writer,
+                             MSymbol              language)
+{
+    ibus_m17n_trace_begin ("scan", language != Mnil ? msymbol_name (language) : NULL);
+
+    ibus_m17n_foreach_engine (language,
+                              (IBusM17NEngineFunc) ibus_m17n_cache_writer_add,
+                              writer);
+
+    ibus_m17n_trace_end ();
+}
+
+/* Copies the engines of the old cache, except that the languages in
+   dirty are listed again where their first engine was.  Those are then
+   marked as listed in dirty. */
+static void
+ibus_m17n_engine_cache_copy (IBusM17NCacheWriter *writer,
+                             FILE                *old_fp,
+                             GHashTable          *dirty)
+{
+    GString *line = g_string_new (NULL);
+
+    while (ibus_m17n_engine_cache_read_line (old_fp, line)) {
+        gchar **fields = g_strsplit (line->str, " ", 3);
+        gpointer listed = NULL;
+        gboolean copy;
+        guint64 n_lines, i;
+
+        if (g_strv_length (fields) != 3 || strcmp (fields[0], "engine") != 0) {
+            g_strfreev (fields);
+            break;
+        }
+        n_lines = g_ascii_strtoull (fields[2], NULL, 10);
+
+        copy = !g_hash_table_lookup_extended (dirty, fields[1], NULL, &listed);
+        if (!copy && !listed) {
+            ibus_m17n_engine_cache_list (writer, msymbol (fields[1]));
+            g_hash_table_insert (dirty, g_strdup (fields[1]), GINT_TO_POINTER (TRUE));
+        }
+        if (copy && writer->cache_fp)
+            fprintf (writer->cache_fp, "engine %s %" G_GUINT64_FORMAT "\n",
+                     fields[1], n_lines);
+        g_strfreev (fields);
+
+        for (i = 0; i < n_lines; i++) {
+            if (!ibus_m17n_engine_cache_read_line (old_fp, line))
+                break;
+            if (!copy)
+                continue;
+            g_string_append_c (line, '\n');
+            fputs (line->str, writer->fp);
+            if (writer->cache_fp)
+                fputs (line->str, writer->cache_fp);
+        }
+    }
+
+    g_string_free (line, TRUE);
+}
+
+void
+ibus_m17n_engine_cache_output (FILE *fp)
+{
+    IBusM17NCacheWriter writer;
+    GHashTable *stamps, *old_entries = NULL, *dirty;
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *files;
+    FILE *old_fp;
+    gchar *filename;
+    gchar *tmpname = NULL;
+    gboolean full, changed;
+
+    filename = ibus_m17n_engine_cache_filename ();
+
+    ibus_m17n_trace_begin ("stamp files", NULL);
+    stamps = ibus_m17n_engine_cache_scan_stamps ();
+    ibus_m17n_trace_end ();
+
+    old_fp = g_fopen (filename, "r");
+    if (old_fp)
+        old_entries = ibus_m17n_engine_cache_load (old_fp);
+    full = changed = old_entries == NULL;
+
+    /* languages whose input methods have to be listed again */
+    dirty = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    files = g_ptr_array_new_with_free_func (g_free);
+
+    g_hash_table_iter_init (&iter, stamps);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        const gchar *path = key;
+        const gchar *stamp = value;
+        IBusM17NCacheEntry *entry = NULL;
+        gchar *lang = NULL;
+
+        if (old_entries)
+            entry = g_hash_table_lookup (old_entries, path);
+
+        if (entry && strcmp (entry->stamp, stamp) == 0) {
+            lang = g_strdup (entry->lang);
+        }
+        else if (g_str_has_suffix (path, ".mim")) {
+            changed = TRUE;
+            if (!ibus_m17n_mim_file_get_name (path, &lang, NULL))
+                full = TRUE;
+            else
+                g_hash_table_insert (dirty, g_strdup (lang), NULL);
+            if (entry && entry->lang)
+                g_hash_table_insert (dirty, g_strdup (entry->lang), NULL);
+        }
+        else {
+            /* default.xml, config.mic or a shared table changed */
+            full = changed = TRUE;
+        }
+
+        g_ptr_array_add (files, g_strdup_printf ("%s %s %s",
+                                                 stamp,
+                                                 lang ? lang : "-",
+                                                 path));
+        g_free (lang);
+    }
+
+    if (old_entries) {
+        g_hash_table_iter_init (&iter, old_entries);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            IBusM17NCacheEntry *entry = value;
+
+            if (g_hash_table_lookup_extended (stamps, key, NULL, NULL))
+                continue;
+            changed = TRUE;
+            if (entry->lang)
+                g_hash_table_insert (dirty, g_strdup (entry->lang), NULL);
+            else
+                full = TRUE;
+        }
+    }
+
+    /* global input methods may be included by any other */
+    if (g_hash_table_lookup_extended (dirty, "t", NULL, NULL))
+        full = TRUE;
+
+    writer.fp = fp;
+    writer.cache_fp = NULL;
+    writer.buf = g_string_new ("");
+    if (changed)
+        writer.cache_fp = ibus_m17n_engine_cache_create (filename, files, &tmpname);
+
+    fputs ("<engines>\n", fp);
+
+    if (full) {
+        ibus_m17n_load_config ();
+        ibus_m17n_engine_cache_list (&writer, Mnil);
+    }
+    else {
+        if (g_hash_table_size (dirty) > 0)
+            ibus_m17n_load_config ();
+
+        ibus_m17n_engine_cache_copy (&writer, old_fp, dirty);
+
+        /* languages which had no input method before */
+        g_hash_table_iter_init (&iter, dirty);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            if (value == NULL)
+                ibus_m17n_engine_cache_list (&writer, msymbol (key));
+    }
+
+    fputs ("</engines>\n", fp);
+    fflush (fp);
+
+    if (old_fp)
+        fclose (old_fp);
+    if (writer.cache_fp)
+        ibus_m17n_engine_cache_commit (writer.cache_fp, tmpname, filename);
+
+    g_string_free (writer.buf, TRUE);
+    g_ptr_array_free (files, TRUE);
+    g_hash_table_destroy (dirty);
+    g_hash_table_destroy (stamps);
+    if (old_entries)
+        g_hash_table_destroy (old_entries);
+    g_free (tmpname);
+    g_free (filename);
+}
@@ -0,0 +1,13 @@
+/* vim:set et sts=4: */
+#ifndef __ENGINECACHE_H__
+#define __ENGINECACHE_H__
+
+#include <stdio.h>
+#include <ibus.h>
+
+/* Writes the <engines> element describing all the input methods to fp
+   as the engines are listed, reusing the descriptions saved by the
+   previous call for the .mim files which did not change since. */
+void    ibus_m17n_engine_cache_output   (FILE           *fp);
+
+#endif
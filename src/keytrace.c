@@ -0,0 +1,237 @@
+/* vim:set et sts=4: */
+#include <stdio.h>
+#include <string.h>
+#include <ibus.h>
+#include "keytrace.h"
+
+struct _IBusM17NKeyTraceReader {
+    FILE *fp;
+    guint32 flags;
+    gchar *name;
+};
+
+static FILE *trace_fp = NULL;
+static gboolean trace_scramble = FALSE;
+static gint64 trace_start = 0;
+static guint trace_engines = 0;
+
+static void
+ibus_m17n_key_trace_put_uint (guchar  *p,
+                              guint64  value,
+                              gint     size)
+{
+    gint i;
+
+    for (i = 0; i < size; i++)
+        p[i] = (value >> (8 * i)) & 0xff;
+}
+
+static guint64
+ibus_m17n_key_trace_get_uint (const guchar *p,
+                              gint          size)
+{
+    guint64 value = 0;
+    gint i;
+
+    for (i = size - 1; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static void
+ibus_m17n_key_trace_write (guint                 engine,
+                           IBusM17NKeyTraceType  type,
+                           guint                 keyval,
+                           guint                 keycode,
+                           guint                 modifiers)
+{
+    guchar record[IBUS_M17N_KEY_TRACE_RECORD_SIZE];
+
+    ibus_m17n_key_trace_put_uint (record, g_get_monotonic_time () - trace_start, 8);
+    ibus_m17n_key_trace_put_uint (record + 8, keyval, 4);
+    ibus_m17n_key_trace_put_uint (record + 12, keycode, 4);
+    ibus_m17n_key_trace_put_uint (record + 16, modifiers, 4);
+    ibus_m17n_key_trace_put_uint (record + 20, engine, 2);
+    record[22] = type;
+    record[23] = 0;
+
+    fwrite (record, sizeof (record), 1, trace_fp);
+}
+
+gboolean
+ibus_m17n_key_trace_open (const gchar *filename,
+                          gboolean     scramble)
+{
+    guchar header[16];
+
+    g_return_val_if_fail (trace_fp == NULL, FALSE);
+
+    trace_fp = fopen (filename, "wb");
+    if (trace_fp == NULL)
+        return FALSE;
+
+    trace_scramble = scramble;
+    trace_start = g_get_monotonic_time ();
+    trace_engines = 0;
+
+    memcpy (header, IBUS_M17N_KEY_TRACE_MAGIC, 8);
+    ibus_m17n_key_trace_put_uint (header + 8, IBUS_M17N_KEY_TRACE_VERSION, 4);
+    ibus_m17n_key_trace_put_uint (header + 12,
+                                  scramble ? IBUS_M17N_KEY_TRACE_SCRAMBLED : 0,
+                                  4);
+    fwrite (header, sizeof (header), 1, trace_fp);
+    fflush (trace_fp);
+
+    return TRUE;
+}
+
+void
+ibus_m17n_key_trace_close (void)
+{
+    if (trace_fp == NULL)
+        return;
+    fclose (trace_fp);
+    trace_fp = NULL;
+}
+
+gboolean
+ibus_m17n_key_trace_is_enabled (void)
+{
+    return trace_fp != NULL;
+}
+
+guint
+ibus_m17n_key_trace_add_engine (const gchar *engine_name)
+{
+    gsize len = strlen (engine_name);
+
+    if (trace_fp == NULL || trace_engines == G_MAXUINT16 ||
+        len > IBUS_M17N_KEY_TRACE_MAX_NAME)
+        return 0;
+
+    /* id 0 is never used, so it can mean "not recorded" */
+    trace_engines++;
+    ibus_m17n_key_trace_write (trace_engines, IBUS_M17N_KEY_TRACE_ENGINE,
+                               len, 0, 0);
+    fwrite (engine_name, len, 1, trace_fp);
+    fflush (trace_fp);
+
+    return trace_engines;
+}
+
+/* Replaces a printable character with a random ASCII one of the same
+   class, whatever script it is in. */
+static guint
+ibus_m17n_key_trace_scramble (gunichar ch)
+{
+    if (g_unichar_islower (ch))
+        return g_random_int_range ('a', 'z' + 1);
+    if (g_unichar_isupper (ch))
+        return g_random_int_range ('A', 'Z' + 1);
+    if (g_unichar_isdigit (ch))
+        return g_random_int_range ('0', '9' + 1);
+    return '.';
+}
+
+void
+ibus_m17n_key_trace_record (guint                engine,
+                            IBusM17NKeyTraceType type,
+                            guint                keyval,
+                            guint                keycode,
+                            guint                modifiers)
+{
+    if (trace_fp == NULL || engine == 0)
+        return;
+
+    if (trace_scramble && type == IBUS_M17N_KEY_TRACE_KEY) {
+        gunichar ch = ibus_keyval_to_unicode (keyval);
+
+        /* the keycode would tell the key on non Latin layouts too */
+        if (ch != 0 && g_unichar_isgraph (ch)) {
+            keyval = ibus_m17n_key_trace_scramble (ch);
+            keycode = 0;
+        }
+    }
+
+    ibus_m17n_key_trace_write (engine, type, keyval, keycode, modifiers);
+    fflush (trace_fp);
+}
+
+IBusM17NKeyTraceReader *
+ibus_m17n_key_trace_reader_new (const gchar *filename)
+{
+    IBusM17NKeyTraceReader *reader;
+    guchar header[16];
+    FILE *fp;
+
+    fp = fopen (filename, "rb");
+    if (fp == NULL) {
+        g_warning ("can not open %s", filename);
+        return NULL;
+    }
+
+    if (fread (header, sizeof (header), 1, fp) != 1 ||
+        memcmp (header, IBUS_M17N_KEY_TRACE_MAGIC, 8) != 0) {
+        g_warning ("%s is not a key event trace", filename);
+        fclose (fp);
+        return NULL;
+    }
+    if (ibus_m17n_key_trace_get_uint (header + 8, 4) != IBUS_M17N_KEY_TRACE_VERSION) {
+        g_warning ("%s has an unsupported version", filename);
+        fclose (fp);
+        return NULL;
+    }
+
+    reader = g_slice_new0 (IBusM17NKeyTraceReader);
+    reader->fp = fp;
+    reader->flags = ibus_m17n_key_trace_get_uint (header + 12, 4);
+    return reader;
+}
+
+guint32
+ibus_m17n_key_trace_reader_get_flags (IBusM17NKeyTraceReader *reader)
+{
+    return reader->flags;
+}
+
+gboolean
+ibus_m17n_key_trace_reader_next (IBusM17NKeyTraceReader *reader,
+                                 IBusM17NKeyTraceEvent  *event)
+{
+    guchar record[IBUS_M17N_KEY_TRACE_RECORD_SIZE];
+
+    if (fread (record, sizeof (record), 1, reader->fp) != 1)
+        return FALSE;
+
+    event->timestamp = ibus_m17n_key_trace_get_uint (record, 8);
+    event->keyval = ibus_m17n_key_trace_get_uint (record + 8, 4);
+    event->keycode = ibus_m17n_key_trace_get_uint (record + 12, 4);
+    event->modifiers = ibus_m17n_key_trace_get_uint (record + 16, 4);
+    event->engine = ibus_m17n_key_trace_get_uint (record + 20, 2);
+    event->type = record[22];
+    event->name = NULL;
+
+    if (event->type == IBUS_M17N_KEY_TRACE_ENGINE) {
+        if (event->keyval > IBUS_M17N_KEY_TRACE_MAX_NAME) {
+            g_warning ("engine name of %u bytes in key event trace",
+                       event->keyval);
+            return FALSE;
+        }
+        g_free (reader->name);
+        reader->name = g_malloc (event->keyval + 1);
+        if (fread (reader->name, 1, event->keyval, reader->fp) != event->keyval)
+            return FALSE;
+        reader->name[event->keyval] = '\0';
+        event->name = reader->name;
+    }
+
+    return TRUE;
+}
+
+void
+ibus_m17n_key_trace_reader_free (IBusM17NKeyTraceReader *reader)
+{
+    fclose (reader->fp);
+    g_free (reader->name);
+    g_slice_free (IBusM17NKeyTraceReader, reader);
+}
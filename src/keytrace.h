@@ -0,0 +1,84 @@
+/* vim:set et sts=4: */
+#ifndef __KEYTRACE_H__
+#define __KEYTRACE_H__
+
+#include <glib.h>
+
+/*
+ * Key event trace file format, version 1.  All integers are little
+ * endian.
+ *
+ *   header: "IM17KEYT", guint32 version, guint32 flags
+ *   record: guint64 timestamp (usec since the trace was opened),
+ *           guint32 keyval, guint32 keycode, guint32 modifiers,
+ *           guint16 engine, guint8 type, guint8 reserved
+ *
+ * An ENGINE record introduces an engine instance.  Its keyval is the
+ * length of the engine name which follows the record, without a
+ * terminating nul.  The engine field of all the other records refers
+ * to the id given by an earlier ENGINE record.
+ *
+ * New record types may be added to a version, so readers skip the types
+ * they do not know.
+ */
+#define IBUS_M17N_KEY_TRACE_MAGIC "IM17KEYT"
+#define IBUS_M17N_KEY_TRACE_VERSION 1
+#define IBUS_M17N_KEY_TRACE_RECORD_SIZE 24
+/* longest engine name of an ENGINE record */
+#define IBUS_M17N_KEY_TRACE_MAX_NAME 256
+
+/* printable keys were replaced by random keys of the same class */
+#define IBUS_M17N_KEY_TRACE_SCRAMBLED (1 << 0)
+
+typedef enum {
+    IBUS_M17N_KEY_TRACE_ENGINE = 0,
+    IBUS_M17N_KEY_TRACE_KEY = 1,
+    IBUS_M17N_KEY_TRACE_FOCUS_IN = 2,
+    IBUS_M17N_KEY_TRACE_FOCUS_OUT = 3,
+    IBUS_M17N_KEY_TRACE_RESET = 4,
+    IBUS_M17N_KEY_TRACE_ENABLE = 5,
+    IBUS_M17N_KEY_TRACE_DISABLE = 6,
+    IBUS_M17N_KEY_TRACE_PAGE_UP = 7,
+    IBUS_M17N_KEY_TRACE_PAGE_DOWN = 8,
+    IBUS_M17N_KEY_TRACE_CURSOR_UP = 9,
+    IBUS_M17N_KEY_TRACE_CURSOR_DOWN = 10,
+} IBusM17NKeyTraceType;
+
+typedef struct _IBusM17NKeyTraceEvent IBusM17NKeyTraceEvent;
+typedef struct _IBusM17NKeyTraceReader IBusM17NKeyTraceReader;
+
+struct _IBusM17NKeyTraceEvent {
+    guint64 timestamp;
+    guint32 keyval;
+    guint32 keycode;
+    guint32 modifiers;
+    guint16 engine;
+    guint8 type;
+    /* engine name of an ENGINE record, owned by the reader */
+    const gchar *name;
+};
+
+/* recorder */
+gboolean ibus_m17n_key_trace_open       (const gchar            *filename,
+                                         gboolean                scramble);
+void     ibus_m17n_key_trace_close      (void);
+gboolean ibus_m17n_key_trace_is_enabled (void);
+guint    ibus_m17n_key_trace_add_engine (const gchar            *engine_name);
+void     ibus_m17n_key_trace_record     (guint                   engine,
+                                         IBusM17NKeyTraceType    type,
+                                         guint                   keyval,
+                                         guint                   keycode,
+                                         guint                   modifiers);
+
+/* reader */
+IBusM17NKeyTraceReader
+        *ibus_m17n_key_trace_reader_new (const gchar            *filename);
+guint32  ibus_m17n_key_trace_reader_get_flags
+                                        (IBusM17NKeyTraceReader *reader);
+gboolean ibus_m17n_key_trace_reader_next
+                                        (IBusM17NKeyTraceReader *reader,
+                                         IBusM17NKeyTraceEvent  *event);
+void     ibus_m17n_key_trace_reader_free
+                                        (IBusM17NKeyTraceReader *reader);
+
+#endif
@@ -1,51 +1,126 @@
 /* vim:set et sts=4: */
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
+#include <glib/gstdio.h>
 #include "m17nutil.h"
+#include "trace.h"
+#ifdef G_OS_UNIX
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 #define N_(text) text
 
-static MConverter *utf8_converter = NULL;
+/* m17n database directory, as in <observed-paths> of m17n.xml */
+#define M17N_SYSTEM_DIR "/usr/share/m17n"
 
-#define DEFAULT_XML (SETUPDIR "/default.xml")
+/* the (input-method LANG NAME) header is expected within this many bytes */
+#define MIM_HEADER_SIZE 4096
 
 struct _IBusM17NEngineConfigNode {
     gchar *name;
     IBusM17NEngineConfig config;
+
+    /* position in default.xml, the first matching entry wins */
+    guint index;
+    /* compiled name, NULL unless it contains wildcards */
+    GPatternSpec *pattern;
 };
 
 typedef struct _IBusM17NEngineConfigNode IBusM17NEngineConfigNode;
 
-static GSList *config_list = NULL;
+/* entries of default.xml, by exact name and wildcards in file order */
+static GHashTable *config_names = NULL;
+static GSList *config_patterns = NULL;
+static gboolean config_loaded = FALSE;
 
 void
 ibus_m17n_init_common (void)
 {
+    ibus_m17n_trace_begin ("M17N_INIT", NULL);
     M17N_INIT ();
+    ibus_m17n_trace_end ();
+}
+
+gsize
+ibus_m17n_mtext_utf8_len (MText *text)
+{
+    enum MTextFormat format;
+    gint nunits, len, i;
+    gsize nbytes = 0;
+
+    if (text == NULL)
+        return 0;
+
+    mtext_data (text, &format, &nunits, NULL, NULL);
+    if (format == MTEXT_FORMAT_US_ASCII || format == MTEXT_FORMAT_UTF_8)
+        return nunits;
+
+    len = mtext_len (text);
+    for (i = 0; i < len; i++)
+        nbytes += g_unichar_to_utf8 (mtext_ref_char (text, i), NULL);
+
+    return nbytes;
+}
+
+gchar *
+ibus_m17n_mtext_to_utf8_buffer (MText *text,
+                                gchar *buf,
+                                gsize  bufsize)
+{
+    enum MTextFormat format;
+    gint nunits, len, i;
+    const gchar *data;
+    gsize nbytes = 0;
+
+    if (text == NULL || bufsize == 0)
+        return NULL;
+
+    /* UTF-8 and ASCII texts are stored in the output encoding already */
+    data = mtext_data (text, &format, &nunits, NULL, NULL);
+    if (format == MTEXT_FORMAT_US_ASCII || format == MTEXT_FORMAT_UTF_8) {
+        if ((gsize) nunits >= bufsize)
+            return NULL;
+        if (nunits > 0)
+            memcpy (buf, data, nunits);
+        buf [nunits] = 0;
+        return buf;
+    }
+
+    len = mtext_len (text);
+    for (i = 0; i < len; i++) {
+        gchar utf8[6];
+        gint n;
 
-    if (utf8_converter == NULL) {
-        utf8_converter = mconv_buffer_converter (Mcoding_utf_8, NULL, 0);
+        n = g_unichar_to_utf8 (mtext_ref_char (text, i), utf8);
+        if (nbytes + n >= bufsize)
+            return NULL;
+        memcpy (buf + nbytes, utf8, n);
+        nbytes += n;
     }
+    buf [nbytes] = 0;
+
+    return buf;
 }
 
 gchar *
 ibus_m17n_mtext_to_utf8 (MText *text)
 {
-    gint bufsize;
+    gsize bufsize;
     gchar *buf;
 
     if (text == NULL)
         return NULL;
 
-    mconv_reset_converter (utf8_converter);
-
-    bufsize = (mtext_len (text) + 1) * 6;
+    bufsize = ibus_m17n_mtext_utf8_len (text) + 1;
     buf = (gchar *) g_malloc (bufsize);
 
-    mconv_rebind_buffer (utf8_converter, buf, bufsize);
-    mconv_encode (utf8_converter, text);
-
-    buf [utf8_converter->nbytes] = 0;
+    if (ibus_m17n_mtext_to_utf8_buffer (text, buf, bufsize) == NULL) {
+        g_free (buf);
+        return NULL;
+    }
 
     return buf;
 }
@@ -53,25 +128,20 @@ ibus_m17n_mtext_to_utf8 (MText *text)
 gunichar *
 ibus_m17n_mtext_to_ucs4 (MText *text, glong *nchars)
 {
-    glong bufsize;
-    gchar *buf;
+    glong len, i;
     gunichar *ucs;
 
     if (text == NULL)
         return NULL;
 
-    mconv_reset_converter (utf8_converter);
-
-    bufsize = (mtext_len (text) + 1) * 6;
-    buf = (gchar *) g_malloc (bufsize);
+    len = mtext_len (text);
+    ucs = g_new (gunichar, len + 1);
+    for (i = 0; i < len; i++)
+        ucs[i] = mtext_ref_char (text, i);
+    ucs[len] = 0;
 
-    mconv_rebind_buffer (utf8_converter, buf, bufsize);
-    if (mconv_encode (utf8_converter, text) < 0) {
-        g_free (buf);
-        return NULL;
-    }
-    ucs = g_utf8_to_ucs4_fast (buf, bufsize, nchars);
-    g_free (buf);
+    if (nchars)
+        *nchars = len;
     return ucs;
 }
 
@@ -148,119 +218,570 @@ ibus_m17n_engine_new (MSymbol  lang,
 MPlist *minput_list (MSymbol language);
 #endif  /* !HAVE_MINPUT_LIST */
 
-GList *
-ibus_m17n_list_engines (void)
+/* whether engines are listed without description and icon */
+static gboolean list_brief = FALSE;
+
+/* Returns the engine of an input method, or NULL if it should not be
+   listed. */
+static IBusEngineDesc *
+ibus_m17n_engine_new_for_im (MSymbol lang,
+                             MSymbol name)
 {
-    GList *engines = NULL;
-    MPlist *imlist;
-    MPlist *elm;
+    IBusEngineDesc *engine;
+    MText *title = NULL;
+    MText *icon = NULL;
+    MText *desc = NULL;
+    MPlist *l;
+    gchar *engine_name;
+    IBusM17NEngineConfig *config;
 
-    imlist = minput_list (Mnil);
-    for (elm = imlist; elm && mplist_key(elm) != Mnil; elm = mplist_next(elm)) {
-        MSymbol lang;
-        MSymbol name;
-        MSymbol sane;
-        MText *title = NULL;
-        MText *icon = NULL;
-        MText *desc = NULL;
-        MPlist *l;
-        gchar *engine_name;
-        IBusM17NEngineConfig *config;
+    /* ignore input-method explicitly blacklisted in default.xml */
+    engine_name = g_strdup_printf ("m17n:%s:%s", msymbol_name (lang), msymbol_name (name));
+    config = ibus_m17n_get_engine_config (engine_name);
+    if (config == NULL) {
+        g_warning ("can't load config for %s", engine_name);
+        g_free (engine_name);
+        return NULL;
+    }
+    if (config->rank < 0) {
+        g_warning ("skipped %s since its rank is lower than 0",
+                   engine_name);
+        g_free (engine_name);
+        return NULL;
+    }
+    g_free (engine_name);
 
-        l = mplist_value (elm);
-        lang = mplist_value (l);
-        l = mplist_next (l);
-        name = mplist_value (l);
-        l = mplist_next (l);
-        sane = mplist_value (l);
+    l = minput_get_variable (lang, name, msymbol ("candidates-charset"));
+    if (l) {
+        /* check candidates encoding */
+        MPlist *sl;
+        MSymbol varname;
+        MText *vardesc;
+        MSymbol varunknown;
+        MSymbol varcharset;
+
+        sl = mplist_value (l);
+        varname  = mplist_value (sl);
+        sl = mplist_next (sl);
+        vardesc = mplist_value (sl);
+        sl = mplist_next (sl);
+        varunknown = mplist_value (sl);
+        sl = mplist_next (sl);
+        varcharset = mplist_value (sl);
+
+        if (varcharset != Mcoding_utf_8 ||
+            varcharset != Mcoding_utf_8_full) {
+            /*
+            g_debug ("%s != %s or %s",
+                        msymbol_name (varcharset),
+                        msymbol_name (Mcoding_utf_8),
+                        msymbol_name (Mcoding_utf_8_full));
+            */
+            m17n_object_unref (l);
+            return NULL;
+        }
+
+    }
+    if (l)
+        m17n_object_unref (l);
+
+    /* the description and icon are left empty in brief listings, see
+       ibus_m17n_get_engine_desc () */
+    if (list_brief)
+        return ibus_m17n_engine_new (lang, name, NULL, NULL, NULL, config);
+
+    desc = minput_get_description (lang, name);
+    l = minput_get_title_icon (lang, name);
+    if (l && mplist_key (l) == Mtext) {
+        title = mplist_value (l);
+    }
 
-        if (sane == Mt) {
-            /* ignore input-method explicitly blacklisted in default.xml */
-            engine_name = g_strdup_printf ("m17n:%s:%s", msymbol_name (lang), msymbol_name (name));
-            config = ibus_m17n_get_engine_config (engine_name);
-            if (config == NULL) {
-                g_warning ("can't load config for %s", engine_name);
+    MPlist *n = mplist_next (l);
+    if (n && mplist_key (n) == Mtext) {
+        icon = mplist_value (n);
+    }
+
+    engine = ibus_m17n_engine_new (lang, name, title, icon, desc, config);
+
+    if (desc)
+        m17n_object_unref (desc);
+    m17n_object_unref (l);
+
+    return engine;
+}
+
+struct _IBusM17NInputMethod {
+    MSymbol lang;
+    MSymbol name;
+};
+
+typedef struct _IBusM17NInputMethod IBusM17NInputMethod;
+
+/* number of processes extracting the input method metadata */
+static gint list_jobs = 1;
+
+void
+ibus_m17n_set_list_brief (gboolean brief)
+{
+    list_brief = brief;
+}
+
+gboolean
+ibus_m17n_get_list_brief (void)
+{
+    return list_brief;
+}
+
+IBusEngineDesc *
+ibus_m17n_get_engine_desc (const gchar *engine_name)
+{
+    IBusEngineDesc *engine = NULL;
+    gchar **strv;
+    gboolean brief = list_brief;
+
+    strv = g_strsplit (engine_name, ":", 3);
+    if (g_strv_length (strv) != 3 || g_strcmp0 (strv[0], "m17n") != 0) {
+        g_strfreev (strv);
+        return NULL;
+    }
+
+    if (mdatabase_find (msymbol ("input-method"),
+                        msymbol (strv[1]),
+                        msymbol (strv[2]),
+                        Mnil)) {
+        ibus_m17n_load_config ();
+
+        list_brief = FALSE;
+        engine = ibus_m17n_engine_new_for_im (msymbol (strv[1]), msymbol (strv[2]));
+        list_brief = brief;
+    }
+
+    g_strfreev (strv);
+    return engine;
+}
+
+void
+ibus_m17n_set_list_jobs (gint jobs)
+{
+    list_jobs = MAX (jobs, 1);
+}
+
+/* Passes the engines to a callback in the order of the input methods,
+   holding only those which are ready before their predecessors. */
+struct _IBusM17NEngineEmitter {
+    GArray *ims;
+    IBusEngineDesc **engines;
+    gboolean *done;
+    guint next;
+    IBusM17NEngineFunc func;
+    gpointer user_data;
+};
+
+typedef struct _IBusM17NEngineEmitter IBusM17NEngineEmitter;
+
+/* Emits the engines which are ready.  If load is TRUE, the input
+   methods which are not done yet are handled in this process. */
+static void
+ibus_m17n_engine_emitter_flush (IBusM17NEngineEmitter *emitter,
+                                gboolean               load)
+{
+    GArray *ims = emitter->ims;
+
+    while (emitter->next < ims->len) {
+        guint i = emitter->next;
+
+        if (!emitter->done[i]) {
+            IBusM17NInputMethod *im = &g_array_index (ims, IBusM17NInputMethod, i);
+
+            if (!load)
+                break;
+            if (ibus_m17n_trace_is_enabled ()) {
+                gchar *engine_name = g_strdup_printf ("m17n:%s:%s",
+                                                      msymbol_name (im->lang),
+                                                      msymbol_name (im->name));
+                ibus_m17n_trace_begin ("input method", engine_name);
                 g_free (engine_name);
-                continue;
             }
-            if (config->rank < 0) {
-                g_warning ("skipped %s since its rank is lower than 0",
-                           engine_name);
-                g_free (engine_name);
+            emitter->engines[i] = ibus_m17n_engine_new_for_im (im->lang, im->name);
+            emitter->done[i] = TRUE;
+            ibus_m17n_trace_end ();
+        }
+
+        if (emitter->engines[i]) {
+            emitter->func (emitter->engines[i], emitter->user_data);
+            g_object_unref (g_object_ref_sink (emitter->engines[i]));
+            emitter->engines[i] = NULL;
+        }
+        emitter->next++;
+    }
+}
+
+#ifdef G_OS_UNIX
+/* A worker sends one record per input method of its shard: the index
+   of the input method and the length of the <engine> element which
+   follows, both in host byte order.  The length is 0 for input methods
+   which are not listed. */
+struct _IBusM17NListRecord {
+    guint32 index;
+    guint32 length;
+};
+
+typedef struct _IBusM17NListRecord IBusM17NListRecord;
+
+static gboolean
+ibus_m17n_write_all (gint         fd,
+                     const gchar *buf,
+                     gsize        len)
+{
+    while (len > 0) {
+        gssize n = write (fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
                 continue;
+            return FALSE;
+        }
+        buf += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static void
+ibus_m17n_list_engines_worker (GArray *ims,
+                               guint   first,
+                               guint   step,
+                               gint    fd)
+{
+    GString *output = g_string_new ("");
+    guint i;
+
+    for (i = first; i < ims->len; i += step) {
+        IBusM17NInputMethod *im = &g_array_index (ims, IBusM17NInputMethod, i);
+        IBusEngineDesc *engine;
+        IBusM17NListRecord record;
+
+        g_string_truncate (output, 0);
+        g_string_append_len (output, (const gchar *) &record, sizeof (record));
+
+        engine = ibus_m17n_engine_new_for_im (im->lang, im->name);
+        if (engine) {
+            ibus_engine_desc_output (engine, output, 0);
+            g_object_unref (g_object_ref_sink (engine));
+        }
+
+        record.index = i;
+        record.length = output->len - sizeof (record);
+        memcpy (output->str, &record, sizeof (record));
+
+        if (!ibus_m17n_write_all (fd, output->str, output->len))
+            _exit (1);
+    }
+    _exit (0);
+}
+
+/* Parses the complete records at the head of buf. */
+static void
+ibus_m17n_list_engines_read_records (GString               *buf,
+                                     IBusM17NEngineEmitter *emitter)
+{
+    GArray *ims = emitter->ims;
+    IBusEngineDesc **engines = emitter->engines;
+    gboolean *done = emitter->done;
+    IBusM17NListRecord record;
+    gsize offset = 0;
+
+    while (buf->len - offset >= sizeof (record)) {
+        memcpy (&record, buf->str + offset, sizeof (record));
+        if (buf->len - offset - sizeof (record) < record.length)
+            break;
+        offset += sizeof (record);
+
+        if (record.index < ims->len && !done[record.index]) {
+            if (record.length == 0) {
+                done[record.index] = TRUE;
             }
-            g_free (engine_name);
-
-            l = minput_get_variable (lang, name, msymbol ("candidates-charset"));
-            if (l) {
-                /* check candidates encoding */
-                MPlist *sl;
-                MSymbol varname;
-                MText *vardesc;
-                MSymbol varunknown;
-                MSymbol varcharset;
-
-                sl = mplist_value (l);
-                varname  = mplist_value (sl);
-                sl = mplist_next (sl);
-                vardesc = mplist_value (sl);
-                sl = mplist_next (sl);
-                varunknown = mplist_value (sl);
-                sl = mplist_next (sl);
-                varcharset = mplist_value (sl);
-
-                if (varcharset != Mcoding_utf_8 ||
-                    varcharset != Mcoding_utf_8_full) {
-                    /*
-                    g_debug ("%s != %s or %s",
-                                msymbol_name (varcharset),
-                                msymbol_name (Mcoding_utf_8),
-                                msymbol_name (Mcoding_utf_8_full));
-                    */
-                    continue;
+            else {
+                gchar *xml = g_strndup (buf->str + offset, record.length);
+                XMLNode *node = ibus_xml_parse_buffer (xml);
+
+                if (node) {
+                    engines[record.index] = ibus_engine_desc_new_from_xml_node (node);
+                    done[record.index] = TRUE;
+                    ibus_xml_free (node);
                 }
-
+                g_free (xml);
             }
-            if (l)
-                m17n_object_unref (l);
+        }
+        offset += record.length;
+    }
+    g_string_erase (buf, 0, offset);
 
-            desc = minput_get_description (lang, name);
-            l = minput_get_title_icon (lang, name);
-            if (l && mplist_key (l) == Mtext) {
-                title = mplist_value (l);
-            }
+    ibus_m17n_engine_emitter_flush (emitter, FALSE);
+}
+
+/* Splits the input methods across jobs forked workers.  Input methods
+   of a worker which failed are handled in this process afterwards. */
+static void
+ibus_m17n_list_engines_parallel (IBusM17NEngineEmitter *emitter,
+                                 gint                   jobs)
+{
+    GArray *ims = emitter->ims;
+    struct pollfd *fds;
+    GString **bufs;
+    pid_t *pids;
+    gint i, nopen = 0;
+
+    fds = g_new0 (struct pollfd, jobs);
+    bufs = g_new0 (GString *, jobs);
+    pids = g_new0 (pid_t, jobs);
+
+    for (i = 0; i < jobs; i++) {
+        gint p[2];
+
+        fds[i].fd = -1;
+        pids[i] = -1;
+
+        if (pipe (p) < 0)
+            continue;
+
+        ibus_m17n_trace_flush ();
+        pids[i] = fork ();
+        if (pids[i] == 0) {
+            gint j;
 
-            MPlist *n = mplist_next (l);
-            if (n && mplist_key (n) == Mtext) {
-                icon = mplist_value (n);
+            ibus_m17n_trace_disable ();
+            close (p[0]);
+            for (j = 0; j < i; j++) {
+                if (fds[j].fd >= 0)
+                    close (fds[j].fd);
             }
+            ibus_m17n_list_engines_worker (ims, i, jobs, p[1]);
+        }
+        close (p[1]);
+        if (pids[i] < 0) {
+            close (p[0]);
+            continue;
+        }
 
-            engines = g_list_append (engines, ibus_m17n_engine_new (lang, name, title, icon, desc, config));
+        fds[i].fd = p[0];
+        fds[i].events = POLLIN;
+        bufs[i] = g_string_new ("");
+        nopen++;
+    }
 
-            if (desc)
-                m17n_object_unref (desc);
-            m17n_object_unref (l);
+    while (nopen > 0) {
+        if (poll (fds, jobs, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (i = 0; i < jobs; i++) {
+            gchar chunk[4096];
+            gssize n;
+
+            if (fds[i].fd < 0 || fds[i].revents == 0)
+                continue;
+
+            n = read (fds[i].fd, chunk, sizeof (chunk));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n > 0) {
+                g_string_append_len (bufs[i], chunk, n);
+                ibus_m17n_list_engines_read_records (bufs[i], emitter);
+                continue;
+            }
+            close (fds[i].fd);
+            fds[i].fd = -1;
+            nopen--;
         }
     }
 
+    for (i = 0; i < jobs; i++) {
+        if (fds[i].fd >= 0)
+            close (fds[i].fd);
+        if (pids[i] > 0)
+            waitpid (pids[i], NULL, 0);
+        if (bufs[i])
+            g_string_free (bufs[i], TRUE);
+    }
+
+    g_free (fds);
+    g_free (bufs);
+    g_free (pids);
+}
+#endif  /* G_OS_UNIX */
+
+void
+ibus_m17n_foreach_engine (MSymbol             language,
+                          IBusM17NEngineFunc  func,
+                          gpointer            user_data)
+{
+    IBusM17NEngineEmitter emitter;
+    GArray *ims;
+    MPlist *imlist;
+    MPlist *elm;
+
+    ims = g_array_new (FALSE, FALSE, sizeof (IBusM17NInputMethod));
+
+    ibus_m17n_trace_begin ("minput_list", NULL);
+    imlist = minput_list (language);
+    ibus_m17n_trace_end ();
+
+    for (elm = imlist; elm && mplist_key(elm) != Mnil; elm = mplist_next(elm)) {
+        IBusM17NInputMethod im;
+        MSymbol sane;
+        MPlist *l;
+
+        l = mplist_value (elm);
+        im.lang = mplist_value (l);
+        l = mplist_next (l);
+        im.name = mplist_value (l);
+        l = mplist_next (l);
+        sane = mplist_value (l);
+
+        if (sane == Mt)
+            g_array_append_val (ims, im);
+    }
+
+    emitter.ims = ims;
+    emitter.engines = g_new0 (IBusEngineDesc *, ims->len);
+    emitter.done = g_new0 (gboolean, ims->len);
+    emitter.next = 0;
+    emitter.func = func;
+    emitter.user_data = user_data;
+
+#ifdef G_OS_UNIX
+    if (list_jobs > 1 && ims->len > 1) {
+        fflush (stdout);
+        fflush (stderr);
+        ibus_m17n_trace_begin ("list in workers", NULL);
+        ibus_m17n_list_engines_parallel (&emitter, MIN (list_jobs, ims->len));
+        ibus_m17n_trace_end ();
+    }
+#endif  /* G_OS_UNIX */
+
+    ibus_m17n_engine_emitter_flush (&emitter, TRUE);
+
+    g_free (emitter.engines);
+    g_free (emitter.done);
+    g_array_free (ims, TRUE);
+
     if (imlist) {
         m17n_object_unref (imlist);
     }
+}
+
+gchar **
+ibus_m17n_get_database_dirs (void)
+{
+    GPtrArray *dirs = g_ptr_array_new ();
+    const gchar *system_dir = g_getenv ("M17NDIR");
+
+    g_ptr_array_add (dirs, g_strdup (system_dir ? system_dir : M17N_SYSTEM_DIR));
+    if (mdatabase_dir)
+        g_ptr_array_add (dirs, g_strdup (mdatabase_dir));
+    g_ptr_array_add (dirs, g_build_filename (g_get_home_dir (), ".m17n.d", NULL));
+    g_ptr_array_add (dirs, NULL);
+
+    return (gchar **) g_ptr_array_free (dirs, FALSE);
+}
+
+static const gchar *
+ibus_m17n_mim_skip_space (const gchar *p)
+{
+    while (g_ascii_isspace (*p))
+        p++;
+    return p;
+}
+
+static gchar *
+ibus_m17n_mim_scan_symbol (const gchar **p)
+{
+    const gchar *start = *p, *end;
+
+    for (end = start; *end && !g_ascii_isspace (*end) && *end != ')'; end++)
+        ;
+    if (end == start || *end == 0)
+        return NULL;
+
+    *p = end;
+    return g_strndup (start, end - start);
+}
+
+gboolean
+ibus_m17n_mim_file_get_name (const gchar  *path,
+                             gchar       **lang,
+                             gchar       **name)
+{
+    gchar buf[MIM_HEADER_SIZE + 1];
+    const gchar *p;
+    FILE *fp;
+    gsize n;
+
+    *lang = NULL;
+    if (name)
+        *name = NULL;
+
+    fp = g_fopen (path, "r");
+    if (fp == NULL)
+        return FALSE;
+    n = fread (buf, 1, MIM_HEADER_SIZE, fp);
+    fclose (fp);
+    buf[n] = 0;
+
+    p = buf;
+    for (;;) {
+        p = ibus_m17n_mim_skip_space (p);
+        if (*p != ';')
+            break;
+        while (*p && *p != '\n')
+            p++;
+    }
 
-    return engines;
+    if (*p++ != '(')
+        return FALSE;
+    p = ibus_m17n_mim_skip_space (p);
+    if (strncmp (p, "input-method", 12) != 0 || !g_ascii_isspace (p[12]))
+        return FALSE;
+    p = ibus_m17n_mim_skip_space (p + 12);
+
+    *lang = ibus_m17n_mim_scan_symbol (&p);
+    if (*lang == NULL)
+        return FALSE;
+    if (name == NULL)
+        return TRUE;
+
+    p = ibus_m17n_mim_skip_space (p);
+    *name = ibus_m17n_mim_scan_symbol (&p);
+    if (*name == NULL) {
+        g_free (*lang);
+        *lang = NULL;
+        return FALSE;
+    }
+    return TRUE;
 }
 
 IBusM17NEngineConfig *
 ibus_m17n_get_engine_config (const gchar *engine_name)
 {
+    IBusM17NEngineConfigNode *exact = NULL;
     GSList *p;
 
-    for (p = config_list; p != NULL; p = p->next) {
+    if (config_names)
+        exact = g_hash_table_lookup (config_names, engine_name);
+
+    for (p = config_patterns; p != NULL; p = p->next) {
         IBusM17NEngineConfigNode *cnode = p->data;
 
-        if (g_pattern_match_simple (cnode->name, engine_name))
+        if (exact && exact->index < cnode->index)
+            break;
+        if (g_pattern_match_string (cnode->pattern, engine_name))
             return &cnode->config;
     }
+    if (exact)
+        return &exact->config;
     g_return_val_if_reached (NULL);
 }
 
@@ -296,21 +817,52 @@ ibus_m17n_engine_config_parse_xml_node (IBusM17NEngineConfigNode *cnode,
     return TRUE;
 }
 
-IBusComponent *
-ibus_m17n_get_component (void)
+static void
+ibus_m17n_engine_config_node_free (IBusM17NEngineConfigNode *cnode)
 {
-    GList *engines, *p;
-    IBusComponent *component;
+    if (cnode->pattern)
+        g_pattern_spec_free (cnode->pattern);
+    g_free (cnode->name);
+    g_slice_free (IBusM17NEngineConfigNode, cnode);
+}
+
+void
+ibus_m17n_reload_config (void)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if (config_names) {
+        g_hash_table_iter_init (&iter, config_names);
+        while (g_hash_table_iter_next (&iter, NULL, &value))
+            ibus_m17n_engine_config_node_free (value);
+        g_hash_table_destroy (config_names);
+        config_names = NULL;
+    }
+    g_slist_foreach (config_patterns,
+                     (GFunc) ibus_m17n_engine_config_node_free,
+                     NULL);
+    g_slist_free (config_patterns);
+    config_patterns = NULL;
+
+    config_loaded = FALSE;
+    ibus_m17n_load_config ();
+}
+
+void
+ibus_m17n_load_config (void)
+{
+    GList *p;
     XMLNode *node;
+    guint index = 0;
 
-    component = ibus_component_new ("org.freedesktop.IBus.M17n",
-                                    N_("M17N"),
-                                    "0.1.0",
-                                    "GPL",
-                                    "Peng Huang <shawn.p.huang@gmail.com>",
-                                    "http://code.google.com/p/ibus/",
-                                    "",
-                                    "ibus-m17n");
+    if (config_loaded)
+        return;
+    config_loaded = TRUE;
+
+    ibus_m17n_trace_begin ("default.xml", NULL);
+
+    config_names = g_hash_table_new (g_str_hash, g_str_equal);
 
     node = ibus_xml_parse_file (DEFAULT_XML);
     if (node && g_strcmp0 (node->name, "engines") == 0) {
@@ -325,36 +877,199 @@ ibus_m17n_get_component (void)
             }
 
             cnode = g_slice_new0 (IBusM17NEngineConfigNode);
-            if (!ibus_m17n_engine_config_parse_xml_node (cnode, sub_node)) {
+            if (!ibus_m17n_engine_config_parse_xml_node (cnode, sub_node) ||
+                cnode->name == NULL) {
+                g_free (cnode->name);
                 g_slice_free (IBusM17NEngineConfigNode, cnode);
                 continue;
             }
-            config_list = g_slist_prepend (config_list, cnode);
+            cnode->index = index++;
+
+            if (strpbrk (cnode->name, "*?")) {
+                cnode->pattern = g_pattern_spec_new (cnode->name);
+                config_patterns = g_slist_prepend (config_patterns, cnode);
+            }
+            else if (!g_hash_table_lookup (config_names, cnode->name)) {
+                g_hash_table_insert (config_names, cnode->name, cnode);
+            }
+            else {
+                /* shadowed by an earlier entry of the same name */
+                g_free (cnode->name);
+                g_slice_free (IBusM17NEngineConfigNode, cnode);
+            }
         }
-        config_list = g_slist_reverse (config_list);
+        config_patterns = g_slist_reverse (config_patterns);
     } else
         g_warning ("failed to parse %s", DEFAULT_XML);
     if (node)
         ibus_xml_free (node);
 
-    engines = ibus_m17n_list_engines ();
+    ibus_m17n_trace_end ();
+}
 
-    for (p = engines; p != NULL; p = p->next)
-        ibus_component_add_engine (component, p->data);
+static void
+ibus_m17n_add_engine (IBusEngineDesc *engine,
+                      IBusComponent  *component)
+{
+    ibus_component_add_engine (component, engine);
+}
 
-    g_list_free (engines);
+IBusComponent *
+ibus_m17n_get_component (void)
+{
+    IBusComponent *component;
+
+    component = ibus_component_new ("org.freedesktop.IBus.M17n",
+                                    N_("M17N"),
+                                    "0.1.0",
+                                    "GPL",
+                                    "Peng Huang <shawn.p.huang@gmail.com>",
+                                    "http://code.google.com/p/ibus/",
+                                    "",
+                                    "ibus-m17n");
+
+    ibus_m17n_trace_begin ("component", NULL);
+
+    ibus_m17n_load_config ();
+
+    ibus_m17n_foreach_engine (Mnil,
+                              (IBusM17NEngineFunc) ibus_m17n_add_engine,
+                              component);
+
+    ibus_m17n_trace_end ();
 
     return component;
 }
 
+#if IBUS_CHECK_VERSION(1,3,99)
+/* config values by section, each section read with a single
+   ibus_config_get_values() call on first use and kept current with
+   ibus_m17n_config_cache_update() */
+static GHashTable *config_cache = NULL;
+
+/* sections ibus_config_get_values() failed for, read key by key */
+static GHashTable *config_unreadable = NULL;
+
+void
+ibus_m17n_config_cache_add_section (const gchar *section,
+                                    GVariant    *dict)
+{
+    GHashTable *values;
+    GVariant *value;
+    GVariantIter iter;
+    gchar *name;
+
+    if (config_cache == NULL)
+        config_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free,
+                                              (GDestroyNotify) g_hash_table_destroy);
+
+    values = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                    g_free,
+                                    (GDestroyNotify) g_variant_unref);
+    g_variant_iter_init (&iter, dict);
+    while (g_variant_iter_next (&iter, "{sv}", &name, &value))
+        g_hash_table_insert (values, name, value);
+
+    g_hash_table_replace (config_cache, g_strdup (section), values);
+    if (config_unreadable)
+        g_hash_table_remove (config_unreadable, section);
+}
+
+static GHashTable *
+ibus_m17n_config_get_section (IBusConfig  *config,
+                              const gchar *section)
+{
+    GHashTable *values = NULL;
+    GVariant *dict;
+
+    if (config_cache)
+        values = g_hash_table_lookup (config_cache, section);
+    if (values)
+        return values;
+
+    if (config_unreadable &&
+        g_hash_table_lookup_extended (config_unreadable, section, NULL, NULL))
+        return NULL;
+
+    dict = ibus_config_get_values (config, section);
+    if (dict == NULL) {
+        if (config_unreadable == NULL)
+            config_unreadable = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       g_free, NULL);
+        g_hash_table_insert (config_unreadable, g_strdup (section), NULL);
+        return NULL;
+    }
+
+    ibus_m17n_config_cache_add_section (section, dict);
+    g_variant_unref (dict);
+
+    return g_hash_table_lookup (config_cache, section);
+}
+
+static GVariant *
+ibus_m17n_config_get_value (IBusConfig         *config,
+                            const gchar        *section,
+                            const gchar        *name,
+                            const GVariantType *type)
+{
+    GHashTable *values;
+    GVariant *value;
+
+    values = ibus_m17n_config_get_section (config, section);
+    if (values) {
+        value = g_hash_table_lookup (values, name);
+        if (value)
+            g_variant_ref (value);
+    } else
+        /* the section could not be read at once */
+        value = ibus_config_get_value (config, section, name);
+
+    if (value && !g_variant_is_of_type (value, type)) {
+        g_variant_unref (value);
+        value = NULL;
+    }
+    return value;
+}
+
+void
+ibus_m17n_config_cache_update (const gchar *section,
+                               const gchar *name,
+                               GVariant    *value)
+{
+    GHashTable *values;
+
+    if (config_cache == NULL)
+        return;
+
+    /* sections not read yet are read in full on first use */
+    values = g_hash_table_lookup (config_cache, section);
+    if (values == NULL)
+        return;
+
+    /* an unset key is signalled with an empty value */
+    if (value == NULL || g_variant_is_of_type (value, G_VARIANT_TYPE_UNIT))
+        g_hash_table_remove (values, name);
+    else
+        g_hash_table_insert (values, g_strdup (name), g_variant_ref (value));
+}
+#endif  /* IBUS_CHECK_VERSION(1,3,99) */
+
 void
 ibus_m17n_config_set_string (IBusConfig  *config,
                              const gchar *section,
                              const gchar *name,
                              const gchar *value)
 {
+    if (config == NULL)
+        return;
+
 #if IBUS_CHECK_VERSION(1,3,99)
-    ibus_config_set_value (config, section, name, g_variant_new_string (value));
+    GVariant *v = g_variant_ref_sink (g_variant_new_string (value));
+
+    ibus_config_set_value (config, section, name, v);
+    ibus_m17n_config_cache_update (section, name, v);
+    g_variant_unref (v);
 #else
     GValue v = { 0 };
 
@@ -375,7 +1090,12 @@ ibus_m17n_config_get_string (IBusConfig  *config,
 
     g_return_val_if_fail (result != NULL, FALSE);
 
-    value = ibus_config_get_value (config, section, name);
+    /* there is no config service without ibus-daemon */
+    if (config == NULL)
+        return FALSE;
+
+    value = ibus_m17n_config_get_value (config, section, name,
+                                        G_VARIANT_TYPE_STRING);
     if (value) {
         *result = g_strdup (g_variant_get_string (value, NULL));
         g_variant_unref (value);
@@ -387,6 +1107,9 @@ ibus_m17n_config_get_string (IBusConfig  *config,
 
     g_return_val_if_fail (result != NULL, FALSE);
 
+    if (config == NULL)
+        return FALSE;
+
     if (ibus_config_get_value (config, section, name, &value)) {
         *result = g_strdup (g_value_get_string (&value));
         g_value_unset (&value);
@@ -402,8 +1125,15 @@ ibus_m17n_config_set_int (IBusConfig  *config,
                           const gchar *name,
                           gint         value)
 {
+    if (config == NULL)
+        return;
+
 #if IBUS_CHECK_VERSION(1,3,99)
-    ibus_config_set_value (config, section, name, g_variant_new_int32 (value));
+    GVariant *v = g_variant_ref_sink (g_variant_new_int32 (value));
+
+    ibus_config_set_value (config, section, name, v);
+    ibus_m17n_config_cache_update (section, name, v);
+    g_variant_unref (v);
 #else
     GValue v = { 0 };
 
@@ -424,7 +1154,11 @@ ibus_m17n_config_get_int (IBusConfig  *config,
 
     g_return_val_if_fail (result != NULL, FALSE);
 
-    value = ibus_config_get_value (config, section, name);
+    if (config == NULL)
+        return FALSE;
+
+    value = ibus_m17n_config_get_value (config, section, name,
+                                        G_VARIANT_TYPE_INT32);
     if (value) {
         *result = g_variant_get_int32 (value);
         g_variant_unref (value);
@@ -436,6 +1170,9 @@ ibus_m17n_config_get_int (IBusConfig  *config,
 
     g_return_val_if_fail (result != NULL, FALSE);
 
+    if (config == NULL)
+        return FALSE;
+
     if (ibus_config_get_value (config, section, name, &value)) {
         *result = g_value_get_int (&value);
         g_value_unset (&value);
@@ -5,6 +5,8 @@
 #include <ibus.h>
 #include <m17n.h>
 
+#define DEFAULT_XML (SETUPDIR "/default.xml")
+
 #define INVALID_COLOR ((guint)-1)
 /* default configuration */
 #define PREEDIT_FOREGROUND 0x00000000
@@ -20,16 +22,41 @@ struct _IBusM17NEngineConfig {
 
 typedef struct _IBusM17NEngineConfig IBusM17NEngineConfig;
 
+/* called with each listed engine, ref_sink it to keep it */
+typedef void (*IBusM17NEngineFunc) (IBusEngineDesc *engine,
+                                    gpointer        user_data);
+
 void           ibus_m17n_init_common       (void);
 void           ibus_m17n_init              (IBusBus     *bus);
-GList         *ibus_m17n_list_engines      (void);
+void           ibus_m17n_load_config       (void);
+void           ibus_m17n_reload_config     (void);
+void           ibus_m17n_set_list_jobs     (gint         jobs);
+void           ibus_m17n_set_list_brief    (gboolean     brief);
+gboolean       ibus_m17n_get_list_brief    (void);
+IBusEngineDesc
+              *ibus_m17n_get_engine_desc   (const gchar *engine_name);
+void           ibus_m17n_foreach_engine    (MSymbol             language,
+                                            IBusM17NEngineFunc  func,
+                                            gpointer            user_data);
 IBusComponent *ibus_m17n_get_component     (void);
+gsize          ibus_m17n_mtext_utf8_len    (MText       *text);
 gchar         *ibus_m17n_mtext_to_utf8     (MText       *text);
+gchar         *ibus_m17n_mtext_to_utf8_buffer
+                                           (MText       *text,
+                                            gchar       *buf,
+                                            gsize        bufsize);
 gunichar      *ibus_m17n_mtext_to_ucs4     (MText       *text,
                                             glong       *nchars);
 guint          ibus_m17n_parse_color       (const gchar *hex);
 IBusM17NEngineConfig
               *ibus_m17n_get_engine_config (const gchar *engine_name);
+/* the directories .mim files are read from, NULL terminated */
+gchar        **ibus_m17n_get_database_dirs (void);
+/* reads LANG and NAME from the (input-method LANG NAME) header of an .mim
+   file; name may be NULL if only the language is needed */
+gboolean       ibus_m17n_mim_file_get_name (const gchar *path,
+                                            gchar      **lang,
+                                            gchar      **name);
 void           ibus_m17n_config_set_string (IBusConfig  *config,
                                             const gchar *section,
                                             const gchar *name,
@@ -46,4 +73,13 @@ gboolean       ibus_m17n_config_get_int    (IBusConfig  *config,
                                             const gchar *section,
                                             const gchar *name,
                                             gint        *result);
+#if IBUS_CHECK_VERSION(1,3,99)
+void           ibus_m17n_config_cache_add_section
+                                           (const gchar *section,
+                                            GVariant    *dict);
+void           ibus_m17n_config_cache_update
+                                           (const gchar *section,
+                                            const gchar *name,
+                                            GVariant    *value);
+#endif  /* IBUS_CHECK_VERSION(1,3,99) */
 #endif
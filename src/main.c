@@ -3,8 +3,17 @@
 #include <ibus.h>
 #include <locale.h>
 #include <m17n.h>
+#include <signal.h>
+#if GLIB_CHECK_VERSION(2,30,0)
+#include <glib-unix.h>
+#endif
 #include "engine.h"
+#include "enginecache.h"
+#include "keytrace.h"
 #include "m17nutil.h"
+#include "stats.h"
+#include "trace.h"
+#include "uiconfig.h"
 
 static IBusBus *bus = NULL;
 static IBusFactory *factory = NULL;
@@ -13,12 +22,26 @@ static IBusFactory *factory = NULL;
 static gboolean xml = FALSE;
 static gboolean ibus = FALSE;
 static gboolean verbose = FALSE;
+static gboolean stats = FALSE;
+static gint jobs = 1;
+static gboolean brief = FALSE;
+static gchar *describe = NULL;
+static gchar *trace = NULL;
+static gchar *record = NULL;
+static gboolean scramble = FALSE;
 
 static const GOptionEntry entries[] =
 {
     { "xml", 'x', 0, G_OPTION_ARG_NONE, &xml, "generate xml for engines", NULL },
     { "ibus", 'i', 0, G_OPTION_ARG_NONE, &ibus, "component is executed by ibus", NULL },
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "verbose", NULL },
+    { "brief", 'b', 0, G_OPTION_ARG_NONE, &brief, "generate xml for engines without description and icon", NULL },
+    { "describe", 'd', 0, G_OPTION_ARG_STRING, &describe, "generate xml for one engine", "ENGINE" },
+    { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, "read input method metadata in N processes", "N" },
+    { "trace", 't', 0, G_OPTION_ARG_FILENAME, &trace, "write a startup trace in chrome://tracing format to FILE", "FILE" },
+    { "record", 'r', 0, G_OPTION_ARG_FILENAME, &record, "record key events to FILE", "FILE" },
+    { "scramble", 0, 0, G_OPTION_ARG_NONE, &scramble, "record printable keys as random keys of the same class", NULL },
+    { "stats", 's', 0, G_OPTION_ARG_NONE, &stats, "collect key event latency statistics, printed on SIGUSR1 and at exit", NULL },
     { NULL },
 };
 
@@ -31,22 +54,48 @@ ibus_disconnected_cb (IBusBus  *bus,
     ibus_quit ();
 }
 
-
-static void
-start_component (void)
+#if IBUS_CHECK_VERSION(1,4,99)
+/* Registers the type of an engine when ibus-daemon first asks for it,
+   instead of registering all the input methods at startup. */
+static IBusEngine *
+create_engine_cb (IBusFactory *factory,
+                  const gchar *engine_name,
+                  gpointer     user_data)
 {
-    GList *engines, *p;
-    IBusComponent *component;
+    static guint engine_id = 0;
+    IBusEngine *engine;
+    gchar *object_path;
+    GType type;
 
-    ibus_init ();
+    if (!g_str_has_prefix (engine_name, "m17n:"))
+        return NULL;
 
-    bus = ibus_bus_new ();
-    g_signal_connect (bus, "disconnected", G_CALLBACK (ibus_disconnected_cb), NULL);
-    ibus_m17n_init (bus);
+    ibus_m17n_trace_begin ("register type", engine_name);
+    type = ibus_m17n_engine_get_type_for_name (engine_name);
+    ibus_m17n_trace_end ();
 
-    component = ibus_m17n_get_component ();
+    if (type == G_TYPE_INVALID) {
+        g_debug ("Can not create engine type for %s", engine_name);
+        return NULL;
+    }
 
-    factory = ibus_factory_new (ibus_bus_get_connection (bus));
+    object_path = g_strdup_printf ("/org/freedesktop/IBus/Engine/M17N/%u",
+                                   ++engine_id);
+    engine = ibus_engine_new_with_type (type,
+                                        engine_name,
+                                        object_path,
+                                        ibus_bus_get_connection (bus));
+    g_free (object_path);
+
+    return engine;
+}
+#endif  /* IBUS_CHECK_VERSION(1,4,99) */
+
+#if !IBUS_CHECK_VERSION(1,4,99)
+static void
+register_engine_types (IBusComponent *component)
+{
+    GList *engines, *p;
 
     engines = ibus_component_get_engines (component);
     for (p = engines; p != NULL; p = p->next) {
@@ -56,46 +105,152 @@ start_component (void)
 #else
         const gchar *engine_name = engine->name;
 #endif  /* !IBUS_CHECK_VERSION(1,3,99) */
-        GType type = ibus_m17n_engine_get_type_for_name (engine_name);
+        GType type;
+
+        ibus_m17n_trace_begin ("register type", engine_name);
+        type = ibus_m17n_engine_get_type_for_name (engine_name);
 
         if (type == G_TYPE_INVALID) {
             g_debug ("Can not create engine type for %s", engine_name);
+            ibus_m17n_trace_end ();
             continue;
         }
         ibus_factory_add_engine (factory, engine_name, type);
+        ibus_m17n_trace_end ();
     }
+}
+#endif  /* !IBUS_CHECK_VERSION(1,4,99) */
+
+#if GLIB_CHECK_VERSION(2,30,0)
+static gboolean
+dump_stats_cb (gpointer user_data)
+{
+    ibus_m17n_stats_dump (stderr);
+    return TRUE;
+}
+#endif
+
+static void
+start_component (void)
+{
+    IBusComponent *component = NULL;
+
+    ibus_init ();
+
+    ibus_m17n_stats_set_enabled (stats);
+    ibus_m17n_ui_config_open ();
+    if (record && !ibus_m17n_key_trace_open (record, scramble))
+        g_printerr ("Can not open key event trace %s\n", record);
 
+    ibus_m17n_trace_begin ("startup", NULL);
+
+    /* list the engines before the bus connection starts its thread,
+       since they may be read in forked processes */
+    ibus_m17n_init_common ();
+#if IBUS_CHECK_VERSION(1,4,99)
+    /* ibus-daemon already has the engine descriptions from --xml and
+       the engine types are registered on demand */
+    if (!ibus)
+        component = ibus_m17n_get_component ();
+#else
+    /* ibus-daemon already has the engine descriptions from --xml,
+       only the names are needed to register the engine types */
+    if (ibus)
+        ibus_m17n_set_list_brief (TRUE);
+    component = ibus_m17n_get_component ();
+#endif  /* !IBUS_CHECK_VERSION(1,4,99) */
+
+#if GLIB_CHECK_VERSION(2,30,0)
+    /* after the engines are listed, as GLib may start a thread to
+       watch the signal */
+    if (stats)
+        g_unix_signal_add (SIGUSR1, dump_stats_cb, NULL);
+#endif
+
+    ibus_m17n_trace_begin ("connect", NULL);
+    bus = ibus_bus_new ();
+    g_signal_connect (bus, "disconnected", G_CALLBACK (ibus_disconnected_cb), NULL);
+    ibus_m17n_init (bus);
+
+    factory = ibus_factory_new (ibus_bus_get_connection (bus));
+    ibus_m17n_trace_end ();
+
+#if IBUS_CHECK_VERSION(1,4,99)
+    g_signal_connect (factory, "create-engine",
+                      G_CALLBACK (create_engine_cb), NULL);
+#else
+    ibus_m17n_trace_begin ("register types", NULL);
+    register_engine_types (component);
+    ibus_m17n_trace_end ();
+#endif  /* !IBUS_CHECK_VERSION(1,4,99) */
+
+    ibus_m17n_trace_begin ("register component", NULL);
     if (ibus) {
         ibus_bus_request_name (bus, "org.freedesktop.IBus.M17N", 0);
     }
     else {
         ibus_bus_register_component (bus, component);
     }
+    ibus_m17n_trace_end ();
+
+    if (component)
+        g_object_unref (component);
+
+    ibus_m17n_trace_end ();
+    /* the component keeps running, finish the trace file now */
+    ibus_m17n_trace_close ();
 
-    g_object_unref (component);
+    ibus_m17n_engine_preload_recent ();
+    ibus_m17n_engine_watch_changes ();
 
     ibus_main ();
+
+    ibus_m17n_engine_save_recent ();
+    ibus_m17n_key_trace_close ();
+    ibus_m17n_ui_config_close ();
+    if (stats)
+        ibus_m17n_stats_dump (stderr);
 }
 
 static void
 print_engines_xml (void)
 {
-    IBusComponent *component;
+    ibus_init ();
+
+    ibus_m17n_trace_begin ("xml", NULL);
+
+    ibus_m17n_init_common ();
+
+    ibus_m17n_engine_cache_output (stdout);
+
+    ibus_m17n_trace_end ();
+
+}
+
+static gboolean
+print_engine_xml (const gchar *engine_name)
+{
+    IBusEngineDesc *engine;
     GString *output;
 
     ibus_init ();
 
     ibus_m17n_init_common ();
 
-    component = ibus_m17n_get_component ();
+    engine = ibus_m17n_get_engine_desc (engine_name);
+    if (engine == NULL)
+        return FALSE;
+
     output = g_string_new ("");
 
-    ibus_component_output_engines (component, output, 0);
+    ibus_engine_desc_output (engine, output, 0);
 
     fprintf (stdout, "%s", output->str);
 
     g_string_free (output, TRUE);
+    g_object_unref (g_object_ref_sink (engine));
 
+    return TRUE;
 }
 
 int
@@ -115,8 +270,26 @@ main (gint argc, gchar **argv)
         exit (-1);
     }
 
+    if (trace && !ibus_m17n_trace_open (trace))
+        g_printerr ("Can not open trace file %s\n", trace);
+
+    ibus_m17n_set_list_jobs (jobs);
+    ibus_m17n_set_list_brief (brief);
+
+    if (describe) {
+        gboolean found = print_engine_xml (describe);
+
+        ibus_m17n_trace_close ();
+        if (!found) {
+            g_printerr ("Unknown engine %s\n", describe);
+            exit (1);
+        }
+        exit (0);
+    }
+
     if (xml) {
         print_engines_xml ();
+        ibus_m17n_trace_close ();
         exit (0);
     }
 
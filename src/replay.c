@@ -0,0 +1,457 @@
+/* vim:set et sts=4: */
+/*
+ * Replays key events to an m17n engine without ibus-daemon.  The engine
+ * is exported on one end of an in-process peer-to-peer D-Bus connection,
+ * the signals it emits are captured there and summarized, and the time
+ * spent per key is reported with the --stats histograms of the engine.
+ *
+ * Input files are either key event traces written with --record or
+ * text, where <Name> stands for the key named Name.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <ibus.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <glib/gstdio.h>
+#include "engine.h"
+#include "keytrace.h"
+#include "m17nutil.h"
+#include "stats.h"
+
+/* the exit status of a skipped test in automake */
+#define EXIT_SKIP 77
+
+#define DEFAULT_ENGINE "m17n:t:latn-post"
+#define DEFAULT_TEXT "a'e`o^u\" c,a~n~ <BackSpace>o/<Return>"
+
+#define ENGINE_PATH "/org/freedesktop/IBus/Engine/%d"
+
+#if IBUS_CHECK_VERSION(1,3,99)
+
+/* options */
+static gchar *engine_name = NULL;
+static gint repeat = 1;
+static gboolean verbose = FALSE;
+
+static const GOptionEntry entries[] =
+{
+    { "engine", 'e', 0, G_OPTION_ARG_STRING, &engine_name, "replay to ENGINE instead of the recorded engines, text is typed to " DEFAULT_ENGINE " by default", "ENGINE" },
+    { "repeat", 'n', 0, G_OPTION_ARG_INT, &repeat, "replay the input N times", "N" },
+    { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "print every signal the engine emits", NULL },
+    { NULL },
+};
+
+/* what the engines sent, updated from the D-Bus worker thread */
+G_LOCK_DEFINE_STATIC (output);
+static GHashTable *signal_counts = NULL;
+static GChecksum *signal_digest = NULL;
+
+static GDBusConnection *engine_connection = NULL;
+static GHashTable *engines = NULL;
+static gint n_engines = 0;
+static guint64 n_keys = 0;
+static gint64 key_usec = 0;
+
+static GDBusMessage *
+replay_filter (GDBusConnection *connection,
+               GDBusMessage    *message,
+               gboolean         incoming,
+               gpointer         user_data)
+{
+    const gchar *member;
+    GVariant *body;
+    gchar *printed;
+    guint count;
+
+    if (incoming ||
+        g_dbus_message_get_message_type (message) != G_DBUS_MESSAGE_TYPE_SIGNAL)
+        return message;
+
+    member = g_dbus_message_get_member (message);
+    body = g_dbus_message_get_body (message);
+    printed = body ? g_variant_print (body, FALSE) : g_strdup ("");
+
+    G_LOCK (output);
+    count = GPOINTER_TO_UINT (g_hash_table_lookup (signal_counts, member));
+    g_hash_table_insert (signal_counts, g_strdup (member), GUINT_TO_POINTER (count + 1));
+    g_checksum_update (signal_digest, (const guchar *) member, -1);
+    g_checksum_update (signal_digest, (const guchar *) printed, -1);
+    if (verbose)
+        g_print ("%s %s\n", member, printed);
+    G_UNLOCK (output);
+
+    g_free (printed);
+
+    /* nobody reads the other end */
+    g_object_unref (message);
+    return NULL;
+}
+
+static void
+replay_connected_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+    GDBusConnection **conn = user_data;
+    GError *error = NULL;
+
+    *conn = g_dbus_connection_new_finish (result, &error);
+    if (*conn == NULL) {
+        g_printerr ("Can not create peer connection: %s\n", error->message);
+        g_error_free (error);
+        exit (1);
+    }
+}
+
+/* Creates the connection the engines are exported on, and its peer. */
+static void
+replay_connect (GDBusConnection **server,
+                GDBusConnection **client)
+{
+    GSocketConnection *streams[2];
+    gchar *guid;
+    gint fds[2];
+    gint i;
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        g_printerr ("Can not create socket pair\n");
+        exit (1);
+    }
+    for (i = 0; i < 2; i++) {
+        GSocket *socket = g_socket_new_from_fd (fds[i], NULL);
+
+        streams[i] = g_socket_connection_factory_create_connection (socket);
+        g_object_unref (socket);
+    }
+
+    *server = *client = NULL;
+    guid = g_dbus_generate_guid ();
+    g_dbus_connection_new (G_IO_STREAM (streams[0]),
+                           guid,
+                           G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER,
+                           NULL, NULL,
+                           replay_connected_cb, server);
+    g_dbus_connection_new (G_IO_STREAM (streams[1]),
+                           NULL,
+                           G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                           NULL, NULL,
+                           replay_connected_cb, client);
+    while (*server == NULL || *client == NULL)
+        g_main_context_iteration (NULL, TRUE);
+    g_free (guid);
+
+    g_object_unref (streams[0]);
+    g_object_unref (streams[1]);
+}
+
+/* Returns the engine for an id of the input, creating it on first use.
+   Each trace numbers its engines from 1, so the engines are looked up by
+   name too. */
+static IBusEngine *
+replay_get_engine (guint        id,
+                   const gchar *name)
+{
+    IBusEngine *engine;
+    IBusEngineDesc *desc;
+    GType type;
+    gchar *key, *path;
+
+    if (engine_name)
+        name = engine_name;
+
+    key = g_strdup_printf ("%u:%s", id, name);
+    engine = g_hash_table_lookup (engines, key);
+    if (engine) {
+        g_free (key);
+        return engine;
+    }
+
+    desc = ibus_m17n_get_engine_desc (name);
+    if (desc == NULL) {
+        g_printerr ("%s is not installed, skipped\n", name);
+        exit (EXIT_SKIP);
+    }
+    g_object_unref (g_object_ref_sink (desc));
+
+    type = ibus_m17n_engine_get_type_for_name (name);
+    path = g_strdup_printf (ENGINE_PATH, ++n_engines);
+    engine = ibus_engine_new_with_type (type, name, path, engine_connection);
+    g_free (path);
+    if (engine == NULL) {
+        g_printerr ("Can not create engine %s\n", name);
+        exit (1);
+    }
+
+    /* let the engine open its input method, which it does in an idle
+       callback, so the keys are not queued and timed meanwhile */
+    while (g_main_context_pending (NULL))
+        g_main_context_iteration (NULL, FALSE);
+
+    g_hash_table_insert (engines, key, engine);
+    return engine;
+}
+
+static void
+replay_event (IBusEngine *engine,
+              guint       type,
+              guint       keyval,
+              guint       keycode,
+              guint       modifiers)
+{
+    IBusEngineClass *klass = IBUS_ENGINE_GET_CLASS (engine);
+    gint64 start;
+
+    switch (type) {
+    case IBUS_M17N_KEY_TRACE_KEY:
+        start = g_get_monotonic_time ();
+        klass->process_key_event (engine, keyval, keycode, modifiers);
+        key_usec += g_get_monotonic_time () - start;
+        n_keys++;
+        break;
+    case IBUS_M17N_KEY_TRACE_FOCUS_IN:
+        klass->focus_in (engine);
+        break;
+    case IBUS_M17N_KEY_TRACE_FOCUS_OUT:
+        klass->focus_out (engine);
+        break;
+    case IBUS_M17N_KEY_TRACE_RESET:
+        klass->reset (engine);
+        break;
+    case IBUS_M17N_KEY_TRACE_ENABLE:
+        klass->enable (engine);
+        break;
+    case IBUS_M17N_KEY_TRACE_DISABLE:
+        klass->disable (engine);
+        break;
+    case IBUS_M17N_KEY_TRACE_PAGE_UP:
+        klass->page_up (engine);
+        break;
+    case IBUS_M17N_KEY_TRACE_PAGE_DOWN:
+        klass->page_down (engine);
+        break;
+    case IBUS_M17N_KEY_TRACE_CURSOR_UP:
+        klass->cursor_up (engine);
+        break;
+    case IBUS_M17N_KEY_TRACE_CURSOR_DOWN:
+        klass->cursor_down (engine);
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+replay_trace (IBusM17NKeyTraceReader *reader)
+{
+    GHashTable *names;
+    IBusM17NKeyTraceEvent event;
+
+    names = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+
+    while (ibus_m17n_key_trace_reader_next (reader, &event)) {
+        const gchar *name;
+
+        if (event.type == IBUS_M17N_KEY_TRACE_ENGINE) {
+            g_hash_table_insert (names,
+                                 GUINT_TO_POINTER ((guint) event.engine),
+                                 g_strdup (event.name));
+            continue;
+        }
+
+        name = g_hash_table_lookup (names, GUINT_TO_POINTER ((guint) event.engine));
+        if (name == NULL)
+            continue;
+
+        replay_event (replay_get_engine (event.engine, name),
+                      event.type,
+                      event.keyval,
+                      event.keycode,
+                      event.modifiers);
+    }
+
+    g_hash_table_destroy (names);
+}
+
+/* Types text, where <Name> is the key named Name. */
+static void
+replay_text (const gchar *text)
+{
+    IBusEngine *engine;
+    const gchar *p;
+
+    engine = replay_get_engine (0, DEFAULT_ENGINE);
+    replay_event (engine, IBUS_M17N_KEY_TRACE_FOCUS_IN, 0, 0, 0);
+
+    for (p = text; *p; p = g_utf8_next_char (p)) {
+        gunichar ch = g_utf8_get_char (p);
+        guint keyval;
+
+        if (ch == '\n')
+            continue;
+
+        if (ch == '<' && strchr (p, '>') && strchr (p, '>') - p > 1) {
+            gchar *name = g_strndup (p + 1, strchr (p, '>') - p - 1);
+
+            keyval = ibus_keyval_from_name (name);
+            if (keyval == IBUS_VoidSymbol)
+                g_printerr ("Unknown key <%s>\n", name);
+            g_free (name);
+            p = strchr (p, '>');
+        }
+        else if (ch < 0x100) {
+            keyval = ch;
+        }
+        else {
+            keyval = 0x01000000 | ch;
+        }
+
+        if (keyval == IBUS_VoidSymbol)
+            continue;
+
+        replay_event (engine, IBUS_M17N_KEY_TRACE_KEY, keyval, 0, 0);
+        replay_event (engine, IBUS_M17N_KEY_TRACE_KEY, keyval, 0,
+                      IBUS_RELEASE_MASK);
+    }
+
+    replay_event (engine, IBUS_M17N_KEY_TRACE_FOCUS_OUT, 0, 0, 0);
+}
+
+static void
+replay_file (const gchar *filename)
+{
+    IBusM17NKeyTraceReader *reader;
+    gchar *contents;
+    GError *error = NULL;
+
+    if (!g_file_get_contents (filename, &contents, NULL, &error)) {
+        g_printerr ("%s\n", error->message);
+        exit (1);
+    }
+
+    if (g_str_has_prefix (contents, IBUS_M17N_KEY_TRACE_MAGIC)) {
+        reader = ibus_m17n_key_trace_reader_new (filename);
+        if (reader == NULL)
+            exit (1);
+        replay_trace (reader);
+        ibus_m17n_key_trace_reader_free (reader);
+    }
+    else {
+        replay_text (contents);
+    }
+    g_free (contents);
+}
+
+static void
+replay_report (GDBusConnection *connection,
+               gint64           elapsed_usec)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    /* the filter sees signals when they are sent */
+    g_dbus_connection_flush_sync (connection, NULL, NULL);
+
+    g_print ("%" G_GUINT64_FORMAT " keys in %.3f ms, %.0f keys/s, "
+             "%.1f us per key\n",
+             n_keys,
+             elapsed_usec / 1000.0,
+             key_usec > 0 ? n_keys * 1e6 / key_usec : 0.0,
+             n_keys > 0 ? (gdouble) key_usec / n_keys : 0.0);
+
+    G_LOCK (output);
+    g_hash_table_iter_init (&iter, signal_counts);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        g_print ("%s: %u\n", (const gchar *) key, GPOINTER_TO_UINT (value));
+    g_print ("output digest: %s\n", g_checksum_get_string (signal_digest));
+    G_UNLOCK (output);
+
+    ibus_m17n_stats_dump (stdout);
+}
+
+static void
+replay_remove_cache (const gchar *cache_dir)
+{
+    gchar *dir = g_build_filename (cache_dir, "ibus-m17n", NULL);
+    gchar *mru = g_build_filename (dir, "mru", NULL);
+
+    g_unlink (mru);
+    g_rmdir (dir);
+    g_rmdir (cache_dir);
+    g_free (mru);
+    g_free (dir);
+}
+
+int
+main (gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    GDBusConnection *peer;
+    gchar *cache_dir;
+    gint64 start;
+    gint i, n;
+
+    setlocale (LC_ALL, "");
+
+    context = g_option_context_new ("[FILE...] - replay key events to an m17n engine");
+    g_option_context_add_main_entries (context, entries, "ibus-m17n");
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print ("Option parsing failed: %s\n", error->message);
+        exit (-1);
+    }
+
+    /* keep the engines from touching the recently used list of the user */
+    cache_dir = g_dir_make_tmp ("ibus-m17n-replay-XXXXXX", NULL);
+    if (cache_dir)
+        g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+
+    ibus_init ();
+    ibus_m17n_stats_set_enabled (TRUE);
+    ibus_m17n_init (NULL);
+    ibus_m17n_load_config ();
+
+    signal_counts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    signal_digest = g_checksum_new (G_CHECKSUM_SHA1);
+    engines = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
+    replay_connect (&engine_connection, &peer);
+    g_dbus_connection_add_filter (engine_connection, replay_filter, NULL, NULL);
+
+    start = g_get_monotonic_time ();
+    for (n = 0; n < repeat; n++) {
+        if (argc < 2)
+            replay_text (DEFAULT_TEXT);
+        for (i = 1; i < argc; i++)
+            replay_file (argv[i]);
+    }
+
+    replay_report (engine_connection, g_get_monotonic_time () - start);
+
+    g_hash_table_destroy (engines);
+    g_object_unref (peer);
+    g_object_unref (engine_connection);
+
+    if (cache_dir) {
+        replay_remove_cache (cache_dir);
+        g_free (cache_dir);
+    }
+
+    return 0;
+}
+
+#else
+
+int
+main (gint argc, gchar **argv)
+{
+    g_printerr ("replaying needs ibus 1.3.99 or later, skipped\n");
+    return EXIT_SKIP;
+}
+
+#endif  /* !IBUS_CHECK_VERSION(1,3,99) */
@@ -0,0 +1,115 @@
+/* vim:set et sts=4: */
+#include "stats.h"
+
+static gboolean enabled = FALSE;
+
+/* every IBusM17NStats created, in creation order */
+static GSList *stats_list = NULL;
+
+static const gchar *phase_names[IBUS_M17N_N_PHASES] = {
+    "key-symbol",
+    "filter",
+    "lookup",
+    "convert",
+    "emit",
+    "total",
+};
+
+void
+ibus_m17n_stats_set_enabled (gboolean value)
+{
+    enabled = value;
+}
+
+gboolean
+ibus_m17n_stats_is_enabled (void)
+{
+    return enabled;
+}
+
+IBusM17NStats *
+ibus_m17n_stats_new (const gchar *name)
+{
+    IBusM17NStats *stats;
+
+    stats = g_slice_new0 (IBusM17NStats);
+    stats->name = g_strdup (name);
+    stats_list = g_slist_append (stats_list, stats);
+
+    return stats;
+}
+
+void
+ibus_m17n_stats_add (IBusM17NStats *stats,
+                     IBusM17NPhase  phase,
+                     gint64         usec)
+{
+    IBusM17NHistogram *histogram;
+    gint bucket;
+
+    g_return_if_fail (stats != NULL);
+    g_return_if_fail (phase < IBUS_M17N_N_PHASES);
+
+    histogram = &stats->phases[phase];
+
+    if (usec < 0)
+        usec = 0;
+    bucket = usec > 0 ? g_bit_storage (usec) : 0;
+    if (bucket >= IBUS_M17N_N_BUCKETS)
+        bucket = IBUS_M17N_N_BUCKETS - 1;
+
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    if (usec > histogram->max)
+        histogram->max = usec;
+}
+
+/* Returns the upper bound of the bucket holding the given percentile,
+   which is exact to within a factor of two. */
+static gint64
+ibus_m17n_histogram_percentile (IBusM17NHistogram *histogram,
+                                gint               percentile)
+{
+    guint64 rank, seen = 0;
+    gint i;
+
+    rank = (histogram->count * percentile + 99) / 100;
+    for (i = 0; i < IBUS_M17N_N_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0)
+            return MIN (i > 0 ? (gint64) 1 << i : 0, histogram->max);
+    }
+    return histogram->max;
+}
+
+void
+ibus_m17n_stats_dump (FILE *fp)
+{
+    GSList *p;
+    gint i;
+
+    for (p = stats_list; p != NULL; p = p->next) {
+        IBusM17NStats *stats = p->data;
+
+        if (stats->phases[IBUS_M17N_PHASE_TOTAL].count == 0)
+            continue;
+
+        fprintf (fp, "%s\n", stats->name);
+        fprintf (fp, "    %-12s %10s %10s %10s %10s\n",
+                 "phase", "count", "p50(us)", "p99(us)", "max(us)");
+        for (i = 0; i < IBUS_M17N_N_PHASES; i++) {
+            IBusM17NHistogram *histogram = &stats->phases[i];
+
+            fprintf (fp, "    %-12s %10" G_GUINT64_FORMAT
+                     " %10" G_GINT64_FORMAT
+                     " %10" G_GINT64_FORMAT
+                     " %10" G_GINT64_FORMAT "\n",
+                     phase_names[i],
+                     histogram->count,
+                     ibus_m17n_histogram_percentile (histogram, 50),
+                     ibus_m17n_histogram_percentile (histogram, 99),
+                     histogram->max);
+        }
+    }
+    fflush (fp);
+}
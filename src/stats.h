@@ -0,0 +1,43 @@
+/* vim:set et sts=4: */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include <ibus.h>
+
+/* phases of handling a key event which are timed separately */
+typedef enum {
+    IBUS_M17N_PHASE_KEY_SYMBOL,
+    IBUS_M17N_PHASE_FILTER,
+    IBUS_M17N_PHASE_LOOKUP,
+    IBUS_M17N_PHASE_CONVERT,
+    IBUS_M17N_PHASE_EMIT,
+    IBUS_M17N_PHASE_TOTAL,
+    IBUS_M17N_N_PHASES
+} IBusM17NPhase;
+
+/* log2 scale: bucket 0 counts 0us, bucket i counts [2^(i-1), 2^i) us */
+#define IBUS_M17N_N_BUCKETS 32
+
+typedef struct _IBusM17NHistogram IBusM17NHistogram;
+typedef struct _IBusM17NStats IBusM17NStats;
+
+struct _IBusM17NHistogram {
+    guint64 count;
+    gint64 max;
+    guint64 buckets[IBUS_M17N_N_BUCKETS];
+};
+
+struct _IBusM17NStats {
+    gchar *name;
+    IBusM17NHistogram phases[IBUS_M17N_N_PHASES];
+};
+
+void           ibus_m17n_stats_set_enabled (gboolean        enabled);
+gboolean       ibus_m17n_stats_is_enabled  (void);
+IBusM17NStats *ibus_m17n_stats_new         (const gchar    *name);
+void           ibus_m17n_stats_add         (IBusM17NStats  *stats,
+                                            IBusM17NPhase   phase,
+                                            gint64          usec);
+void           ibus_m17n_stats_dump        (FILE           *fp);
+#endif
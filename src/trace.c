@@ -0,0 +1,109 @@
+/* vim:set et sts=4: */
+#include <stdio.h>
+#include <unistd.h>
+#include "trace.h"
+
+static FILE *trace_fp = NULL;
+static gboolean trace_first = TRUE;
+
+static void
+ibus_m17n_trace_write_string (const gchar *str)
+{
+    const guchar *p;
+
+    fputc ('"', trace_fp);
+    for (p = (const guchar *) str; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf (trace_fp, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf (trace_fp, "\\u%04x", *p);
+        else
+            fputc (*p, trace_fp);
+    }
+    fputc ('"', trace_fp);
+}
+
+static void
+ibus_m17n_trace_event (const gchar *phase,
+                       const gchar *name,
+                       const gchar *engine)
+{
+    fputs (trace_first ? "\n" : ",\n", trace_fp);
+    trace_first = FALSE;
+
+    fputs ("{\"name\":", trace_fp);
+    ibus_m17n_trace_write_string (name ? name : "");
+    fprintf (trace_fp,
+             ",\"cat\":\"startup\",\"ph\":\"%s\",\"ts\":%" G_GINT64_FORMAT
+             ",\"pid\":%d,\"tid\":1",
+             phase,
+             g_get_monotonic_time (),
+             (gint) getpid ());
+    if (engine) {
+        fputs (",\"args\":{\"engine\":", trace_fp);
+        ibus_m17n_trace_write_string (engine);
+        fputc ('}', trace_fp);
+    }
+    fputc ('}', trace_fp);
+}
+
+gboolean
+ibus_m17n_trace_open (const gchar *filename)
+{
+    g_return_val_if_fail (trace_fp == NULL, FALSE);
+
+    trace_fp = fopen (filename, "w");
+    if (trace_fp == NULL)
+        return FALSE;
+
+    trace_first = TRUE;
+    fputs ("{\"traceEvents\":[", trace_fp);
+    return TRUE;
+}
+
+void
+ibus_m17n_trace_close (void)
+{
+    if (trace_fp == NULL)
+        return;
+
+    fputs ("\n],\"displayTimeUnit\":\"ms\"}\n", trace_fp);
+    fclose (trace_fp);
+    trace_fp = NULL;
+}
+
+void
+ibus_m17n_trace_flush (void)
+{
+    if (trace_fp)
+        fflush (trace_fp);
+}
+
+/* Stops tracing without writing anything, e.g. in a forked child
+   sharing the trace file with its parent. */
+void
+ibus_m17n_trace_disable (void)
+{
+    trace_fp = NULL;
+}
+
+gboolean
+ibus_m17n_trace_is_enabled (void)
+{
+    return trace_fp != NULL;
+}
+
+void
+ibus_m17n_trace_begin (const gchar *name,
+                       const gchar *engine)
+{
+    if (trace_fp)
+        ibus_m17n_trace_event ("B", name, engine);
+}
+
+void
+ibus_m17n_trace_end (void)
+{
+    if (trace_fp)
+        ibus_m17n_trace_event ("E", NULL, NULL);
+}
@@ -0,0 +1,19 @@
+/* vim:set et sts=4: */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <glib.h>
+
+/* Startup tracing in the trace event format of chrome://tracing. Spans
+   are nested by calling begin and end in pairs. Nothing is written
+   unless a trace file is open. */
+gboolean ibus_m17n_trace_open       (const gchar    *filename);
+void     ibus_m17n_trace_close      (void);
+void     ibus_m17n_trace_flush      (void);
+void     ibus_m17n_trace_disable    (void);
+gboolean ibus_m17n_trace_is_enabled (void);
+void     ibus_m17n_trace_begin      (const gchar    *name,
+                                     const gchar    *engine);
+void     ibus_m17n_trace_end        (void);
+
+#endif
@@ -0,0 +1,314 @@
+/* vim:set et sts=4: */
+#include <string.h>
+#include "uiconfig.h"
+
+/* seconds to gather updates before the snapshot is written */
+#define SAVE_DELAY 2
+
+static gboolean enabled = FALSE;
+
+/* the snapshot as last read or written */
+static GMappedFile *mapped = NULL;
+static const guchar *data = NULL;
+static gsize data_length = 0;
+static guint32 generation = 0;
+static guint32 n_records = 0;
+
+/* values not written yet, by engine name */
+static GHashTable *updates = NULL;
+static guint save_id = 0;
+
+static void
+ibus_m17n_ui_config_put_uint (guchar  *p,
+                              guint32  value)
+{
+    gint i;
+
+    for (i = 0; i < 4; i++)
+        p[i] = (value >> (8 * i)) & 0xff;
+}
+
+static guint32
+ibus_m17n_ui_config_get_uint (const guchar *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+static gchar *
+ibus_m17n_ui_config_filename (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "ibus-m17n", "ui-config", NULL);
+}
+
+static void
+ibus_m17n_ui_config_unmap (void)
+{
+    if (mapped)
+        g_mapped_file_unref (mapped);
+    mapped = NULL;
+    data = NULL;
+    data_length = 0;
+    generation = 0;
+    n_records = 0;
+}
+
+/* Maps the snapshot, which is left unmapped if missing or invalid. */
+static void
+ibus_m17n_ui_config_map (void)
+{
+    GMappedFile *file;
+    const guchar *contents;
+    gchar *filename;
+    gsize length;
+    guint32 count;
+
+    ibus_m17n_ui_config_unmap ();
+
+    filename = ibus_m17n_ui_config_filename ();
+    file = g_mapped_file_new (filename, FALSE, NULL);
+    g_free (filename);
+    if (file == NULL)
+        return;
+
+    contents = (const guchar *) g_mapped_file_get_contents (file);
+    length = g_mapped_file_get_length (file);
+
+    if (length < IBUS_M17N_UI_CONFIG_HEADER_SIZE ||
+        memcmp (contents, IBUS_M17N_UI_CONFIG_MAGIC, 8) != 0 ||
+        ibus_m17n_ui_config_get_uint (contents + 8) != IBUS_M17N_UI_CONFIG_VERSION) {
+        g_mapped_file_unref (file);
+        return;
+    }
+
+    count = ibus_m17n_ui_config_get_uint (contents + 16);
+    if (count > (length - IBUS_M17N_UI_CONFIG_HEADER_SIZE) /
+                IBUS_M17N_UI_CONFIG_RECORD_SIZE ||
+        (count > 0 && contents[length - 1] != '\0')) {
+        g_mapped_file_unref (file);
+        return;
+    }
+
+    mapped = file;
+    data = contents;
+    data_length = length;
+    generation = ibus_m17n_ui_config_get_uint (contents + 12);
+    n_records = count;
+}
+
+static const guchar *
+ibus_m17n_ui_config_record (guint32 index)
+{
+    return data + IBUS_M17N_UI_CONFIG_HEADER_SIZE +
+        index * IBUS_M17N_UI_CONFIG_RECORD_SIZE;
+}
+
+/* Returns the engine name of a record, or NULL if it is out of bounds. */
+static const gchar *
+ibus_m17n_ui_config_record_name (guint32 index)
+{
+    guint32 offset = ibus_m17n_ui_config_get_uint (ibus_m17n_ui_config_record (index));
+
+    if (offset < IBUS_M17N_UI_CONFIG_HEADER_SIZE +
+                 n_records * IBUS_M17N_UI_CONFIG_RECORD_SIZE ||
+        offset >= data_length)
+        return NULL;
+    return (const gchar *) data + offset;
+}
+
+static void
+ibus_m17n_ui_config_record_get (guint32           index,
+                                IBusM17NUIConfig *config)
+{
+    const guchar *record = ibus_m17n_ui_config_record (index);
+
+    config->preedit_foreground = ibus_m17n_ui_config_get_uint (record + 4);
+    config->preedit_background = ibus_m17n_ui_config_get_uint (record + 8);
+    config->preedit_underline = (gint32) ibus_m17n_ui_config_get_uint (record + 12);
+    config->lookup_table_orientation = (gint32) ibus_m17n_ui_config_get_uint (record + 16);
+}
+
+static gboolean
+ibus_m17n_ui_config_find (const gchar      *engine_name,
+                          IBusM17NUIConfig *config)
+{
+    guint32 lo = 0, hi = n_records;
+
+    while (lo < hi) {
+        guint32 mid = lo + (hi - lo) / 2;
+        const gchar *name = ibus_m17n_ui_config_record_name (mid);
+        gint cmp;
+
+        if (name == NULL)
+            return FALSE;
+
+        cmp = strcmp (engine_name, name);
+        if (cmp == 0) {
+            ibus_m17n_ui_config_record_get (mid, config);
+            return TRUE;
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return FALSE;
+}
+
+static void
+ibus_m17n_ui_config_save (void)
+{
+    GHashTable *entries;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *names, *p;
+    GString *buf;
+    gchar *filename, *dirname;
+    guint32 i, count;
+    GError *error = NULL;
+
+    /* another process may have written the snapshot meanwhile */
+    ibus_m17n_ui_config_map ();
+
+    entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    for (i = 0; i < n_records; i++) {
+        const gchar *name = ibus_m17n_ui_config_record_name (i);
+        IBusM17NUIConfig *config;
+
+        if (name == NULL)
+            continue;
+        config = g_new (IBusM17NUIConfig, 1);
+        ibus_m17n_ui_config_record_get (i, config);
+        g_hash_table_replace (entries, g_strdup (name), config);
+    }
+
+    g_hash_table_iter_init (&iter, updates);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        IBusM17NUIConfig *config = g_new (IBusM17NUIConfig, 1);
+
+        *config = *(IBusM17NUIConfig *) value;
+        g_hash_table_replace (entries, g_strdup (key), config);
+    }
+
+    names = g_list_sort (g_hash_table_get_keys (entries), (GCompareFunc) strcmp);
+    count = g_hash_table_size (entries);
+
+    buf = g_string_new (NULL);
+    g_string_set_size (buf, IBUS_M17N_UI_CONFIG_HEADER_SIZE +
+                            count * IBUS_M17N_UI_CONFIG_RECORD_SIZE);
+    memcpy (buf->str, IBUS_M17N_UI_CONFIG_MAGIC, 8);
+    ibus_m17n_ui_config_put_uint ((guchar *) buf->str + 8, IBUS_M17N_UI_CONFIG_VERSION);
+    ibus_m17n_ui_config_put_uint ((guchar *) buf->str + 12, generation + 1);
+    ibus_m17n_ui_config_put_uint ((guchar *) buf->str + 16, count);
+    ibus_m17n_ui_config_put_uint ((guchar *) buf->str + 20, 0);
+
+    for (p = names, i = 0; p != NULL; p = p->next, i++) {
+        const gchar *name = p->data;
+        IBusM17NUIConfig *config = g_hash_table_lookup (entries, name);
+        guchar *record = (guchar *) buf->str + IBUS_M17N_UI_CONFIG_HEADER_SIZE +
+            i * IBUS_M17N_UI_CONFIG_RECORD_SIZE;
+
+        ibus_m17n_ui_config_put_uint (record, buf->len);
+        ibus_m17n_ui_config_put_uint (record + 4, config->preedit_foreground);
+        ibus_m17n_ui_config_put_uint (record + 8, config->preedit_background);
+        ibus_m17n_ui_config_put_uint (record + 12, config->preedit_underline);
+        ibus_m17n_ui_config_put_uint (record + 16, config->lookup_table_orientation);
+        g_string_append_len (buf, name, strlen (name) + 1);
+    }
+    g_list_free (names);
+    g_hash_table_destroy (entries);
+
+    filename = ibus_m17n_ui_config_filename ();
+    dirname = g_path_get_dirname (filename);
+    g_mkdir_with_parents (dirname, 0700);
+    if (!g_file_set_contents (filename, buf->str, buf->len, &error)) {
+        g_debug ("Can not write %s: %s", filename, error->message);
+        g_error_free (error);
+    }
+    g_free (dirname);
+    g_free (filename);
+    g_string_free (buf, TRUE);
+
+    g_hash_table_remove_all (updates);
+    ibus_m17n_ui_config_map ();
+}
+
+static gboolean
+ibus_m17n_ui_config_save_cb (gpointer user_data)
+{
+    save_id = 0;
+    ibus_m17n_ui_config_save ();
+    return FALSE;
+}
+
+gboolean
+ibus_m17n_ui_config_open (void)
+{
+    if (enabled)
+        return mapped != NULL;
+
+    enabled = TRUE;
+    updates = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    ibus_m17n_ui_config_map ();
+
+    return mapped != NULL;
+}
+
+void
+ibus_m17n_ui_config_close (void)
+{
+    if (!enabled)
+        return;
+
+    if (save_id) {
+        g_source_remove (save_id);
+        save_id = 0;
+        ibus_m17n_ui_config_save ();
+    }
+    ibus_m17n_ui_config_unmap ();
+    g_hash_table_destroy (updates);
+    updates = NULL;
+    enabled = FALSE;
+}
+
+gboolean
+ibus_m17n_ui_config_lookup (const gchar      *engine_name,
+                            IBusM17NUIConfig *config)
+{
+    IBusM17NUIConfig *update;
+
+    if (!enabled)
+        return FALSE;
+
+    update = g_hash_table_lookup (updates, engine_name);
+    if (update) {
+        *config = *update;
+        return TRUE;
+    }
+    return ibus_m17n_ui_config_find (engine_name, config);
+}
+
+void
+ibus_m17n_ui_config_update (const gchar            *engine_name,
+                            const IBusM17NUIConfig *config)
+{
+    IBusM17NUIConfig current, *update;
+
+    if (!enabled)
+        return;
+
+    if (ibus_m17n_ui_config_lookup (engine_name, &current) &&
+        current.preedit_foreground == config->preedit_foreground &&
+        current.preedit_background == config->preedit_background &&
+        current.preedit_underline == config->preedit_underline &&
+        current.lookup_table_orientation == config->lookup_table_orientation)
+        return;
+
+    update = g_new (IBusM17NUIConfig, 1);
+    *update = *config;
+    g_hash_table_replace (updates, g_strdup (engine_name), update);
+
+    if (save_id == 0)
+        save_id = g_timeout_add_seconds (SAVE_DELAY,
+                                         ibus_m17n_ui_config_save_cb,
+                                         NULL);
+}
@@ -0,0 +1,43 @@
+/* vim:set et sts=4: */
+#ifndef __UICONFIG_H__
+#define __UICONFIG_H__
+
+#include <glib.h>
+
+/*
+ * Snapshot of the UI configuration of the engines, so that they can be
+ * shown right after login before the config service replies.  All
+ * integers are little endian.
+ *
+ *   header: "IM17UICF", guint32 version, guint32 generation,
+ *           guint32 number of records, guint32 reserved
+ *   record: guint32 offset of the engine name, guint32 preedit_foreground,
+ *           guint32 preedit_background, gint32 preedit_underline,
+ *           gint32 lookup_table_orientation
+ *
+ * The records are sorted by engine name, and the nul terminated names
+ * follow the last record.  Offsets count from the start of the file.  The
+ * generation is incremented each time the file is written.
+ */
+#define IBUS_M17N_UI_CONFIG_MAGIC "IM17UICF"
+#define IBUS_M17N_UI_CONFIG_VERSION 1
+#define IBUS_M17N_UI_CONFIG_HEADER_SIZE 24
+#define IBUS_M17N_UI_CONFIG_RECORD_SIZE 20
+
+typedef struct _IBusM17NUIConfig IBusM17NUIConfig;
+
+struct _IBusM17NUIConfig {
+    guint preedit_foreground;
+    guint preedit_background;
+    gint preedit_underline;
+    gint lookup_table_orientation;
+};
+
+gboolean ibus_m17n_ui_config_open   (void);
+void     ibus_m17n_ui_config_close  (void);
+gboolean ibus_m17n_ui_config_lookup (const gchar            *engine_name,
+                                     IBusM17NUIConfig       *config);
+void     ibus_m17n_ui_config_update (const gchar            *engine_name,
+                                     const IBusM17NUIConfig *config);
+
+#endif